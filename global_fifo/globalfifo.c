@@ -7,212 +7,2116 @@
 #include <linux/wait.h>			/* for wait_up_interrruptible */
 #include <linux/poll.h>			/* for poll_table */
 #include <linux/platform_device.h>	/* for platform_device */
+#include <linux/log2.h>			/* for is_power_of_2() */
+#include <linux/vmalloc.h>		/* for vmalloc_user() */
+#include <linux/mm.h>			/* for remap_vmalloc_range() */
+#include <linux/percpu.h>		/* for alloc_percpu() */
+#include <linux/ktime.h>		/* for ktime_get_ns() */
+#include <linux/kfifo.h>		/* for kfifo_rec_ptr_2 */
+#include <linux/eventfd.h>		/* for eventfd_signal() */
+#include <linux/rcupdate.h>
+#include <linux/splice.h>		/* for splice_to_pipe() */
+#include <linux/pipe_fs_i.h>		/* for pipe_buffer */
+#include <linux/highmem.h>		/* for kmap() */
+
+#include "globalfifo.h"
+
+#define GLOBALMEM_SIZE 4096		/* fifo的大小，必须是2的幂 */
+#define GLOBALFIFO_MIN_SIZE 64		/* FIFO_SET_SIZE允许的范围 */
+#define GLOBALFIFO_MAX_SIZE (4 << 20)
+#define GLOBALFIFO_PAGE_SLOTS 64	/* 页模式最多引用的页数，必须是2的幂 */
+#define DEVICE_NUM 4
+
+static struct class *globalmem_class;
+static char *chr_dev_name[20] = {"global_mem_0", "global_mem_1", "global_mem_2", "global_mem_3"};
+
+enum {
+	GLOBALFIFO_MUTEX,	/* 默认模式，读写都持有mutex */
+	GLOBALFIFO_SPSC,	/* 单生产者单消费者，读写指针用acquire/release同步，快速路径不持有锁，支持mmap */
+	GLOBALFIFO_PERCPU,	/* 每个CPU一个子环，写进程只写本CPU的子环，读进程合并所有子环 */
+	GLOBALFIFO_RECORD,	/* 记录模式，用kfifo的记录fifo保存消息，一次write是一条消息，一次read读一条消息 */
+	GLOBALFIFO_BCAST,	/* 广播模式，每个读文件有自己的读指针，所有读者都读到同样的数据 */
+	GLOBALFIFO_PAGE,	/* 页模式，fifo中保存页的引用，splice读写时只传递页不拷贝数据 */
+};
+
+/* PERCPU模式下读进程合并子环的顺序 */
+enum {
+	GLOBALFIFO_ORDER_CPU,	/* 轮流读各个子环，只保证同一个CPU上写入的数据有序 */
+	GLOBALFIFO_ORDER_TS,	/* 每次读时间戳最早的一帧，近似全局的写入顺序 */
+};
+
+/* 每个设备的工作模式，例如 fifo_mode=0,1 表示global_mem_1工作在SPSC模式 */
+static int fifo_mode[DEVICE_NUM];
+module_param_array(fifo_mode, int, NULL, 0444);
+
+/* PERCPU模式下的合并顺序，例如 fifo_mode=2 fifo_order=1 */
+static int fifo_order[DEVICE_NUM];
+module_param_array(fifo_order, int, NULL, 0444);
+
+/*
+ * 广播模式下fifo满时的策略，例如 fifo_mode=4 fifo_drop=1
+ * 0: 写进程等待最慢的读者；1: 丢弃最慢的读者，它下一次read返回EPIPE
+ */
+static int fifo_drop[DEVICE_NUM];
+module_param_array(fifo_drop, int, NULL, 0444);
+
+/* PERCPU模式下每次write是子环中的一帧，帧头后面是数据 */
+struct globalfifo_frame {
+	u64 ts;			/* 写入时的ktime_get_ns()，按时间戳合并时使用 */
+	u32 len;		/* 数据的长度，不包括帧头 */
+	u32 pad;
+};
+
+/*
+ * PERCPU模式的子环，用alloc_percpu分配，每个CPU的子环在自己的per-cpu区域中
+ * 同一个CPU上的写进程用lock互斥，不同CPU上的写进程之间没有共享的锁和cache line
+ * 读进程持有dev->mutex，和每个子环的写进程之间像SPSC模式一样用acquire/release同步
+ */
+struct globalfifo_pcpu {
+	struct mutex lock;		/* 写进程之间互斥，只和同一个CPU上的写进程竞争 */
+	unsigned char *mem;		/* 子环的缓冲区，在CPU所在的NUMA节点上分配 */
+	unsigned int in;		/* 写指针，持有lock的写进程更新 */
+
+	/* 读进程更新的部分放在单独的cache line，不和写进程抢 */
+	unsigned int out ____cacheline_aligned_in_smp;
+	unsigned int partial;		/* 当前帧还没有读走的数据长度，0表示下次从帧头开始读 */
+};
+
+/* 页模式的fifo中的一段数据：页中从offset开始的len字节，fifo持有页的一个引用 */
+struct globalfifo_page {
+	struct page *page;
+	unsigned int offset;
+	unsigned int len;
+	bool own;		/* write分配的页，后面没有用的空间可以接着写；splice进来的页不能写 */
+};
+
+struct global_mem_dev {
+	struct cdev cdev;
+	/*
+	 * 控制页和环形缓冲区在同一块vmalloc_user内存中，控制页在前，
+	 * 控制页中的写指针in和读指针out只增不减，溢出回绕后in - out仍然是数据长度
+	 */
+	struct globalfifo_ring *ring;
+	unsigned char *mem;			/* 环形缓冲区，紧跟在控制页后面，FIFO_SET_SIZE之后是mem_alloc */
+	unsigned char *mem_alloc;		/* FIFO_SET_SIZE单独分配的缓冲区，没有改过大小时为NULL */
+	unsigned int size;			/* 缓冲区大小，是2的幂，取余可以用 & (size - 1) */
+	struct mutex mutex;
+	wait_queue_head_t r_wait;	/* 读等待队列 */
+	wait_queue_head_t w_wait;	/* 写等待队列 */
+	struct fasync_struct *async_queue;
+	int mode;				/* GLOBALFIFO_MUTEX 或 GLOBALFIFO_SPSC */
+	struct file *reader;			/* SPSC模式下第一个调用read的文件，独占读 */
+	struct file *writer;			/* SPSC模式下第一个调用write的文件，独占写 */
+	unsigned int read_wm;			/* 读水位：数据达到read_wm字节才唤醒读进程 */
+	unsigned int write_wm;			/* 写水位：空间达到write_wm字节才唤醒写进程 */
+	struct globalfifo_pcpu __percpu *pcpu;	/* PERCPU模式的子环 */
+	int order;				/* PERCPU模式的合并顺序 */
+	int pcpu_cur;				/* 读了一半的帧所在的CPU，-1表示没有 */
+	int pcpu_next;				/* GLOBALFIFO_ORDER_CPU下一次从哪个CPU开始找 */
+	struct kfifo_rec_ptr_2 rec;		/* 记录模式的fifo，每条消息前面有2字节的长度 */
+	struct list_head readers;		/* 广播模式下所有读文件的globalfifo_reader */
+	int drop;				/* 广播模式下是否丢弃最慢的读者 */
+	unsigned int max_len;			/* 统计：数据长度的最大值 */
+	u64 full;				/* 统计：写进程遇到fifo满的次数 */
+	struct eventfd_ctx __rcu *event[2];	/* FIFO_SET_EVENTFD注册的可读、可写eventfd */
+	struct file *event_owner[2];		/* 注册eventfd的文件，关闭时取消注册 */
+	struct globalfifo_page *pages;		/* 页模式的环，GLOBALFIFO_PAGE_SLOTS个槽 */
+	unsigned int page_in;			/* 页模式的写下标，只增不减，持有mutex更新 */
+	unsigned int page_out;			/* 页模式的读下标 */
+	unsigned int page_bytes;		/* 页模式中的数据长度 */
+};
+
+/*
+ * 广播模式下每个以读方式打开的文件一个，挂在filp->private_data上
+ * 读指针out各自独立，ring->out是所有读者中最小的读指针，它之前的空间才可以被覆盖
+ */
+struct globalfifo_reader {
+	struct global_mem_dev *dev;
+	struct list_head list;		/* 挂在dev->readers上，只写打开的文件不挂 */
+	unsigned int out;		/* 这个读者的读指针 */
+	bool dropped;			/* 被丢弃过，下一次read返回EPIPE */
+};
+
+struct global_mem_dev *global_mem_devp;
+
+dev_t devno; /* 为了在init和exit函数中使用，要用到全局变量 */
+
+/* 表示当前在fifo中剩余的长度 */
+static inline unsigned int fifo_len(struct global_mem_dev *dev)
+{
+	return READ_ONCE(dev->ring->in) - READ_ONCE(dev->ring->out);
+}
+
+/* 表示当前fifo中空闲的长度 */
+static inline unsigned int fifo_avail(struct global_mem_dev *dev)
+{
+	return READ_ONCE(dev->size) - fifo_len(dev);
+}
+
+/* 写进程写入之后记录数据长度的最大值，mutex模式下持有mutex，SPSC模式下只有一个写者 */
+static inline void fifo_update_max(struct global_mem_dev *dev, unsigned int len)
+{
+	if (len > dev->max_len)
+		WRITE_ONCE(dev->max_len, len);
+}
+
+/* 写进程遇到fifo满，需要等待或者返回EAGAIN时调用 */
+static inline void fifo_count_full(struct global_mem_dev *dev)
+{
+	WRITE_ONCE(dev->full, dev->full + 1);
+}
+
+/* 水位不能超过缓冲区的大小，否则永远等不到 */
+static inline unsigned int fifo_read_wm(struct global_mem_dev *dev)
+{
+	return min(READ_ONCE(dev->read_wm), dev->size);
+}
+
+static inline unsigned int fifo_write_wm(struct global_mem_dev *dev)
+{
+	return min(READ_ONCE(dev->write_wm), dev->size);
+}
+
+/* 唤醒时带上的key，epoll只唤醒关心这个方向的等待者 */
+#define FIFO_POLLIN	(EPOLLIN | EPOLLRDNORM)
+#define FIFO_POLLOUT	(EPOLLOUT | EPOLLWRNORM)
+
+/*
+ * 通知dir方向注册的eventfd，eventfd_signal不会睡眠，可以在rcu读临界区中调用
+ * 调用者保证只在poll状态从没有就绪变为就绪时调用，多次就绪合并成一次通知
+ */
+static void fifo_signal_event(struct global_mem_dev *dev, int dir)
+{
+	struct eventfd_ctx *ctx;
+
+	if (!rcu_access_pointer(dev->event[dir]))
+		return;
+
+	rcu_read_lock();
+	ctx = rcu_dereference(dev->event[dir]);
+	if (ctx)
+		eventfd_signal(ctx, 1);
+	rcu_read_unlock();
+}
+
+/*
+ * 阻塞的读写进程和EPOLLEXCLUSIVE的epoll都是独占等待，一次只唤醒其中一个，
+ * 非独占的poll/epoll全部唤醒，带key之后只关心另一个方向的epoll不会被唤醒
+ * SPSC模式下先清掉唤醒标志再唤醒，队列中还有等待者(例如epoll)或者注册了eventfd时重新置1，
+ * 否则EPOLLET的epoll在下一次用户空间移动指针时收不到门铃
+ */
+static void fifo_wake(struct global_mem_dev *dev, int dir)
+{
+	wait_queue_head_t *q = dir == GLOBALFIFO_EVENT_READ ? &dev->r_wait : &dev->w_wait;
+	__u32 *wakeup = dir == GLOBALFIFO_EVENT_READ ? &dev->ring->read_wakeup : &dev->ring->write_wakeup;
+
+	WRITE_ONCE(*wakeup, 0);
+	wake_up_interruptible_poll(q, dir == GLOBALFIFO_EVENT_READ ? FIFO_POLLIN : FIFO_POLLOUT);
+	if (waitqueue_active(q) || rcu_access_pointer(dev->event[dir]))
+		WRITE_ONCE(*wakeup, 1);
+}
+
+/*
+ * 数据达到读水位时唤醒一个读进程，没有读进程在等待时不需要唤醒，返回是否达到读水位
+ * 写进程写入之后调用；被唤醒的读进程读完之后也调用，还有数据就把唤醒传给下一个读进程
+ * smp_mb和读进程"加入等待队列 -> smp_mb -> 检查长度"配对，不会丢失唤醒
+ */
+static bool fifo_wake_readers(struct global_mem_dev *dev)
+{
+	smp_mb();
+	if (fifo_len(dev) < fifo_read_wm(dev))
+		return false;
+
+	if (waitqueue_active(&dev->r_wait))
+		fifo_wake(dev, GLOBALFIFO_EVENT_READ);
+
+	return true;
+}
+
+/*
+ * 写进程移动in之后调用，old_len是写之前的数据长度
+ * SIGIO和eventfd只在数据长度从读水位之下越过读水位时通知一次
+ */
+static void fifo_notify_readers(struct global_mem_dev *dev, unsigned int old_len)
+{
+	if (!fifo_wake_readers(dev) || old_len >= fifo_read_wm(dev))
+		return;
+
+	fifo_signal_event(dev, GLOBALFIFO_EVENT_READ);
+
+	/* 当设备的数据越过读水位之后，它变得可读，释放SIGIO信号*/
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+/* 空间达到写水位时唤醒一个写进程，读进程读完和被唤醒的写进程写完之后调用 */
+static void fifo_wake_writers(struct global_mem_dev *dev)
+{
+	smp_mb();
+	if (dev->size - fifo_len(dev) < fifo_write_wm(dev))
+		return;
+
+	if (waitqueue_active(&dev->w_wait))
+		fifo_wake(dev, GLOBALFIFO_EVENT_WRITE);
+}
+
+/* 读进程移动out之后调用，old_len是读之前的数据长度，空间越过写水位时通知eventfd */
+static void fifo_notify_writers(struct global_mem_dev *dev, unsigned int old_len)
+{
+	unsigned int wm = fifo_write_wm(dev);
+
+	fifo_wake_writers(dev);
+	if (dev->size - old_len < wm && fifo_avail(dev) >= wm)
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+}
+
+/*
+ * 从读指针out开始拷贝count字节到用户空间，数据在缓冲区末尾回绕时分两段拷贝
+ * 返回没有拷贝成功的字节数，和copy_to_user一样
+ * mem和size是环形缓冲区，PERCPU模式下的子环也用这两个函数
+ */
+static unsigned long ring_copy_to_user(unsigned char *mem, unsigned int size, char __user *buf,
+				       unsigned int count, unsigned int out)
+{
+	unsigned int off = out & (size - 1);
+	unsigned int l = min(count, size - off);
+	unsigned long left;
+
+	left = copy_to_user(buf, mem + off, l);
+	if (left)
+		return left + count - l;
+
+	return copy_to_user(buf + l, mem, count - l);
+}
+
+/* 从写指针in开始把用户空间的count字节拷贝到缓冲区，同样处理回绕 */
+static unsigned long ring_copy_from_user(unsigned char *mem, unsigned int size, const char __user *buf,
+					 unsigned int count, unsigned int in)
+{
+	unsigned int off = in & (size - 1);
+	unsigned int l = min(count, size - off);
+	unsigned long left;
+
+	left = copy_from_user(mem + off, buf, l);
+	if (left)
+		return left + count - l;
+
+	return copy_from_user(mem, buf + l, count - l);
+}
+
+static inline unsigned long fifo_copy_to_user(struct global_mem_dev *dev, char __user *buf,
+					      unsigned int count, unsigned int out)
+{
+	return ring_copy_to_user(dev->mem, dev->size, buf, count, out);
+}
+
+static inline unsigned long fifo_copy_from_user(struct global_mem_dev *dev, const char __user *buf,
+						unsigned int count, unsigned int in)
+{
+	return ring_copy_from_user(dev->mem, dev->size, buf, count, in);
+}
+
+static int global_mem_fasync(int fd, struct file *filp, int mode)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	return fasync_helper(fd, filp, mode, &dev->async_queue);
+}
+
+int global_mem_open(struct inode *inode, struct file *filp)
+{
+	/* 在设备驱动中默认将设备指针挂接在文件的私有数据中，在后续只需要对文件的私有数据进行操作即可 */
+	//filp->private_data = global_mem_devp;
+	struct global_mem_dev *dev = container_of(inode->i_cdev, struct global_mem_dev, cdev);
+	filp->private_data = dev;
+
+	return 0;
+}
+
+/*
+ * SPSC模式的无锁读写依赖只有一个读者和一个写者：第一个调用read(write)的文件
+ * 独占读(写)，其他文件再调用返回-EBUSY，直到它被关闭。
+ * 只mmap而不调用read/write的用户空间生产者(消费者)不占用
+ */
+static inline bool fifo_claim(struct file **owner, struct file *filp)
+{
+	struct file *cur = READ_ONCE(*owner);
+
+	if (likely(cur == filp))
+		return true;
+
+	return !cur && !cmpxchg(owner, NULL, filp);
+}
+
+/*
+ * FIFO_SET_EVENTFD：给dir方向注册一个eventfd，fd为-1时取消注册
+ * 每个方向只能注册一个，属于注册它的文件，文件关闭时自动取消
+ * 注册时已经就绪就立即通知一次，否则调用者可能永远等不到边沿
+ */
+static long global_mem_set_eventfd(struct global_mem_dev *dev, struct file *filp, unsigned long args)
+{
+	struct globalfifo_eventfd ev;
+	struct eventfd_ctx *ctx = NULL, *old;
+	__poll_t mask;
+
+	if (copy_from_user(&ev, (void __user *)args, sizeof(ev)))
+		return -EFAULT;
+	if (ev.dir > GLOBALFIFO_EVENT_WRITE)
+		return -EINVAL;
+
+	if (ev.fd >= 0) {
+		ctx = eventfd_ctx_fdget(ev.fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	mutex_lock(&dev->mutex);
+	if (dev->event_owner[ev.dir] && dev->event_owner[ev.dir] != filp) {
+		mutex_unlock(&dev->mutex);
+		if (ctx)
+			eventfd_ctx_put(ctx);
+		return -EBUSY;
+	}
+	old = rcu_dereference_protected(dev->event[ev.dir], lockdep_is_held(&dev->mutex));
+	rcu_assign_pointer(dev->event[ev.dir], ctx);
+	dev->event_owner[ev.dir] = ctx ? filp : NULL;
+	mutex_unlock(&dev->mutex);
+
+	/* 等正在通知旧eventfd的路径退出rcu读临界区之后才能释放 */
+	if (old) {
+		synchronize_rcu();
+		eventfd_ctx_put(old);
+	}
+
+	if (!ctx)
+		return 0;
+
+	/* SPSC模式下用户空间的生产者(消费者)看到唤醒标志才会敲门铃 */
+	if (dev->mode == GLOBALFIFO_SPSC) {
+		if (ev.dir == GLOBALFIFO_EVENT_READ)
+			WRITE_ONCE(dev->ring->read_wakeup, 1);
+		else
+			WRITE_ONCE(dev->ring->write_wakeup, 1);
+		smp_mb();
+	}
+
+	mask = vfs_poll(filp, NULL);
+	if (mask & (ev.dir == GLOBALFIFO_EVENT_READ ? EPOLLIN : EPOLLOUT))
+		eventfd_signal(ctx, 1);
+
+	return 0;
+}
+
+/* 文件关闭时取消它注册的eventfd */
+static void global_mem_event_release(struct global_mem_dev *dev, struct file *filp)
+{
+	struct eventfd_ctx *old[2] = { NULL, NULL };
+	int dir;
+
+	mutex_lock(&dev->mutex);
+	for (dir = GLOBALFIFO_EVENT_READ; dir <= GLOBALFIFO_EVENT_WRITE; dir++) {
+		if (dev->event_owner[dir] != filp)
+			continue;
+		old[dir] = rcu_dereference_protected(dev->event[dir], lockdep_is_held(&dev->mutex));
+		RCU_INIT_POINTER(dev->event[dir], NULL);
+		dev->event_owner[dir] = NULL;
+	}
+	mutex_unlock(&dev->mutex);
+
+	if (!old[0] && !old[1])
+		return;
+
+	synchronize_rcu();
+	for (dir = GLOBALFIFO_EVENT_READ; dir <= GLOBALFIFO_EVENT_WRITE; dir++)
+		if (old[dir])
+			eventfd_ctx_put(old[dir]);
+}
+
+int global_mem_release(struct inode *inode, struct file *filp)
+{
+	struct global_mem_dev *dev = filp->private_data;
+
+	/* 将文件从异步通知列表中删除 */
+	global_mem_fasync(-1, filp, 0);
+	global_mem_event_release(dev, filp);
+
+	cmpxchg(&dev->reader, filp, NULL);
+	cmpxchg(&dev->writer, filp, NULL);
+
+	return 0;
+}
+
+static ssize_t global_mem_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	int ret = 0;
+	unsigned int len;
+	struct global_mem_dev *dev = filp->private_data;
+
+	/* 申请等待队列wait */
+	DECLARE_WAITQUEUE(wait, current);
+
+	/* 独占等待，一次写入只唤醒一个读进程，不会所有读进程一起醒来抢数据 */
+	mutex_lock(&dev->mutex);
+	add_wait_queue_exclusive(&dev->r_wait, &wait);
+
+	/* 判断FIFO 中的数据是否达到读水位，没有达到则需要等待写进程移动in   */
+	while (fifo_len(dev) < fifo_read_wm(dev)) {
+		/* 非阻塞方式:
+		 * 和socket的SO_RCVLOWAT一样，有数据就直接读走，
+		 * fifo为空才返回EAGIAN，释放mutex
+		 */
+		if (filp->f_flags & O_NONBLOCK) {
+			if (fifo_len(dev))
+				break;
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		/* 阻塞方式:
+		 * 需要讲进程状态设置为TASK_INTERRRUPTIBLE，可以被信号唤醒，即所谓的浅度睡眠
+		 * 释放mutex，调用schedule()，调取其他进程。
+		 */
+		printk("globelmem read before schedule.\n");
+		__set_current_state(TASK_INTERRUPTIBLE);
+		/* 在把自己切换出去 时，要释放锁，以便读进程可以拿到 */
+		mutex_unlock(&dev->mutex); 
+		schedule();
+
+		/* 如果是因为被信号唤醒了，则返回ERESTARTSYS 将r_wait移除队列，
+		 * 并且把进程状态设置为TASK_RUNNING 
+		 */
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			goto out2;
+		}
+
+		/* 
+		 * 再次进入的时候，需要再次获得锁，这里对应的是unlock可能是schedule之前的
+		 * 也可能是最后返回时的锁	
+		 */
+		mutex_lock(&dev->mutex);
+	}
+
+	if (count > fifo_len(dev)) {
+		count = fifo_len(dev);
+	}
+
+	/* 只拷贝成功的部分才算读走了，全部失败才返回EFAULT */
+	count -= fifo_copy_to_user(dev, buf, count, dev->ring->out);
+	if (!count) {
+		ret = -EFAULT;
+		goto out;
+	} else {
+		/* 环形缓冲区只需要移动读指针，不需要搬移剩下的数据 */
+		len = fifo_len(dev);
+		dev->ring->out += count;
+		pr_debug("read %zu byte(s), len:%u\n", count, fifo_len(dev));
+
+		/* 读进程完成，空间达到写水位时唤醒可能阻塞的写进程 */
+		fifo_notify_writers(dev, len);
+
+		ret = count;
+	}
+
+out:
+	mutex_unlock(&dev->mutex);
+
+out2:
+	remove_wait_queue(&dev->r_wait, &wait);
+	set_current_state(TASK_RUNNING);
+
+	/* 被唤醒之后没有读完数据，或者被信号打断，把唤醒传给下一个读进程 */
+	if (ret != -EAGAIN)
+		fifo_wake_readers(dev);
+	
+	return ret;
+
+}
+
+static ssize_t global_mem_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+	int ret = 0;
+	unsigned int len;
+	struct global_mem_dev *dev = filp->private_data;
+	DECLARE_WAITQUEUE(wait, current);	/* 定义等待队列wait */
+
+	mutex_lock(&dev->mutex);
+	add_wait_queue_exclusive(&dev->w_wait, &wait);	/* 独占地添加到w_wait等待队列 */
+
+	/* 空间达到写水位才写入，非阻塞方式只要有空间就写入 */
+	while (fifo_avail(dev) < fifo_write_wm(dev)) {
+		fifo_count_full(dev);
+		if (filp->f_flags &O_NONBLOCK) {
+			if (fifo_avail(dev))
+				break;
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		printk("globelmem write before schedule.\n");
+		__set_current_state(TASK_INTERRUPTIBLE);
+		mutex_unlock(&dev->mutex);
+		/* 把自己切换出去 */
+		schedule();
+
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			goto out2;
+		}
+
+		mutex_lock(&dev->mutex);
+	}
+
+	if (count > fifo_avail(dev))
+		count = fifo_avail(dev);
+
+	len = fifo_len(dev);
+	count -= fifo_copy_from_user(dev, buf, count, dev->ring->in);
+	if (!count) {
+		ret = -EFAULT;
+		goto out;
+	} else {
+		dev->ring->in += count;
+		fifo_update_max(dev, fifo_len(dev));
+		pr_debug("write %zu byte(s) len:%u\n", count, fifo_len(dev));
+
+		/* 写进程完成了，数据达到读水位时唤醒可能阻塞的读进程 */
+		fifo_notify_readers(dev, len);
+
+		ret = count;
+	}
+	
+out:
+	mutex_unlock(&dev->mutex);
+out2:
+	remove_wait_queue(&dev->w_wait, &wait);
+	set_current_state(TASK_RUNNING);
+
+	/* 还有空间就把唤醒传给下一个写进程 */
+	if (ret != -EAGAIN)
+		fifo_wake_writers(dev);
+	
+	return ret;
+}
+
+/*
+ * SPSC模式：只有一个读者和一个写者，读指针out只由读者修改，写指针in只由写者修改
+ * 一方拷贝完数据后用smp_store_release发布自己的指针，另一方用smp_load_acquire读取，
+ * 保证看到新指针的时候，指针之前的数据(或者空间)已经可以使用了。
+ * 只有fifo空(或满)需要睡眠时才用到等待队列
+ *
+ * 控制页可以被mmap到用户空间，对端可能是用户空间的生产者(消费者)，
+ * 指针可能被用户空间改坏，拷贝之前必须检查长度不超过缓冲区大小
+ */
+static ssize_t global_mem_spsc_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	struct globalfifo_ring *ring = dev->ring;
+	unsigned int out, len;
+	DEFINE_WAIT(wait);
+
+	if (!fifo_claim(&dev->reader, filp))
+		return -EBUSY;
+
+	for (;;) {
+		out = READ_ONCE(ring->out);
+		len = smp_load_acquire(&ring->in) - out;
+		if (len >= fifo_read_wm(dev))
+			break;
+
+		if (filp->f_flags & O_NONBLOCK) {
+			if (len)
+				break;
+			return -EAGAIN;
+		}
+
+		/*
+		 * 先加入等待队列，再告诉生产者需要敲门铃，最后再检查一次fifo，
+		 * 和生产者"更新in -> 全屏障 -> 检查read_wakeup"配对，不会丢失唤醒
+		 */
+		prepare_to_wait(&dev->r_wait, &wait, TASK_INTERRUPTIBLE);
+		WRITE_ONCE(ring->read_wakeup, 1);
+		smp_mb();
+		if (smp_load_acquire(&ring->in) - READ_ONCE(ring->out) < fifo_read_wm(dev) &&
+		    !signal_pending(current))
+			schedule();
+		finish_wait(&dev->r_wait, &wait);
+
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+
+	if (len > dev->size)
+		return -EIO;
+
+	if (count > len)
+		count = len;
+
+	count -= fifo_copy_to_user(dev, buf, count, out);
+	if (!count)
+		return -EFAULT;
+
+	/* 数据读走之后再发布新的读指针，写者看到新的out时这部分空间才会被覆盖 */
+	smp_store_release(&ring->out, out + count);
+
+	fifo_notify_writers(dev, len);
+
+	pr_debug("spsc read %zu byte(s)\n", count);
+
+	return count;
+}
+
+static ssize_t global_mem_spsc_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	struct globalfifo_ring *ring = dev->ring;
+	unsigned int in, len;
+	DEFINE_WAIT(wait);
+
+	if (!fifo_claim(&dev->writer, filp))
+		return -EBUSY;
+
+	for (;;) {
+		in = READ_ONCE(ring->in);
+		len = in - smp_load_acquire(&ring->out);
+		/* len比size大说明指针被用户空间改坏了，在下面返回EIO */
+		if (len > dev->size || dev->size - len >= fifo_write_wm(dev))
+			break;
+
+		fifo_count_full(dev);
+		if (filp->f_flags & O_NONBLOCK) {
+			if (len != dev->size)
+				break;
+			return -EAGAIN;
+		}
+
+		prepare_to_wait(&dev->w_wait, &wait, TASK_INTERRUPTIBLE);
+		WRITE_ONCE(ring->write_wakeup, 1);
+		smp_mb();
+		if (dev->size - (READ_ONCE(ring->in) - smp_load_acquire(&ring->out)) < fifo_write_wm(dev) &&
+		    !signal_pending(current))
+			schedule();
+		finish_wait(&dev->w_wait, &wait);
+
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+
+	if (len > dev->size)
+		return -EIO;
+
+	if (count > dev->size - len)
+		count = dev->size - len;
+
+	count -= fifo_copy_from_user(dev, buf, count, in);
+	if (!count)
+		return -EFAULT;
+
+	/* 数据写完之后再发布新的写指针 */
+	smp_store_release(&ring->in, in + count);
+	fifo_update_max(dev, len + count);
+
+	fifo_notify_readers(dev, len);
+
+	pr_debug("spsc write %zu byte(s)\n", count);
+
+	return count;
+}
+
+/* 在环形缓冲区的idx位置写入(读出)内核中的数据，处理回绕，PERCPU模式用来读写帧头 */
+static void ring_put(unsigned char *mem, unsigned int size, const void *from,
+		     unsigned int len, unsigned int idx)
+{
+	unsigned int off = idx & (size - 1);
+	unsigned int l = min(len, size - off);
+
+	memcpy(mem + off, from, l);
+	memcpy(mem, from + l, len - l);
+}
+
+static void ring_get(unsigned char *mem, unsigned int size, void *to,
+		     unsigned int len, unsigned int idx)
+{
+	unsigned int off = idx & (size - 1);
+	unsigned int l = min(len, size - off);
+
+	memcpy(to, mem + off, l);
+	memcpy(to + l, mem, len - l);
+}
+
+/* 子环中是否还有没读的数据，读写进程都可以调用 */
+static inline bool pcpu_ring_empty(struct globalfifo_pcpu *r)
+{
+	return smp_load_acquire(&r->in) == READ_ONCE(r->out);
+}
+
+static bool pcpu_pending(struct global_mem_dev *dev)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (!pcpu_ring_empty(per_cpu_ptr(dev->pcpu, cpu)))
+			return true;
+
+	return false;
+}
+
+/*
+ * 选出下一帧所在的CPU，持有dev->mutex，没有数据时返回-1
+ * 读了一半的帧要先读完，否则一次write的数据会被别的帧隔开
+ */
+static int pcpu_pick(struct global_mem_dev *dev)
+{
+	struct globalfifo_pcpu *r;
+	struct globalfifo_frame hdr;
+	u64 ts = U64_MAX;
+	int cpu, i, best = -1;
+
+	if (dev->pcpu_cur >= 0)
+		return dev->pcpu_cur;
+
+	if (dev->order == GLOBALFIFO_ORDER_TS) {
+		for_each_possible_cpu(cpu) {
+			r = per_cpu_ptr(dev->pcpu, cpu);
+			if (pcpu_ring_empty(r))
+				continue;
+
+			ring_get(r->mem, dev->size, &hdr, sizeof(hdr), r->out);
+			if (hdr.ts < ts) {
+				ts = hdr.ts;
+				best = cpu;
+			}
+		}
+		return best;
+	}
+
+	/* 从上次的下一个CPU开始轮流找，避免一个写得快的CPU饿死其他CPU */
+	for (i = 0; i < nr_cpu_ids; i++) {
+		cpu = (dev->pcpu_next + i) % nr_cpu_ids;
+		if (!cpu_possible(cpu) || pcpu_ring_empty(per_cpu_ptr(dev->pcpu, cpu)))
+			continue;
+
+		dev->pcpu_next = (cpu + 1) % nr_cpu_ids;
+		return cpu;
+	}
+
+	return -1;
+}
+
+/* 有数据时唤醒一个读进程 */
+static void pcpu_wake_readers(struct global_mem_dev *dev)
+{
+	smp_mb();
+	if (waitqueue_active(&dev->r_wait) && pcpu_pending(dev))
+		wake_up_interruptible_poll(&dev->r_wait, FIFO_POLLIN);
+}
+
+/*
+ * PERCPU模式的读：持有dev->mutex，同一时间只有一个读进程
+ * 按合并顺序一帧一帧地拷贝数据，直到用户的缓冲区满或者所有子环都空了
+ */
+static ssize_t global_mem_pcpu_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	struct globalfifo_pcpu *r;
+	struct globalfifo_frame hdr;
+	unsigned int out, n;
+	unsigned long left;
+	size_t copied = 0;
+	ssize_t ret = 0;
+	DEFINE_WAIT(wait);
+	int cpu;
+
+	if (!count)
+		return 0;
+
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+
+	while (!pcpu_pending(dev)) {
+		if (filp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		/*
+		 * 读进程之间独占等待，一次写入只唤醒一个读进程
+		 * prepare_to_wait之后再检查，和写进程发布in之后的smp_mb配对
+		 */
+		prepare_to_wait_exclusive(&dev->r_wait, &wait, TASK_INTERRUPTIBLE);
+		mutex_unlock(&dev->mutex);
+		if (!pcpu_pending(dev))
+			schedule();
+		finish_wait(&dev->r_wait, &wait);
+
+		if (signal_pending(current)) {
+			pcpu_wake_readers(dev);
+			return -ERESTARTSYS;
+		}
+		if (mutex_lock_interruptible(&dev->mutex)) {
+			pcpu_wake_readers(dev);
+			return -ERESTARTSYS;
+		}
+	}
+
+	while (copied < count) {
+		cpu = pcpu_pick(dev);
+		if (cpu < 0)
+			break;
+
+		r = per_cpu_ptr(dev->pcpu, cpu);
+		out = r->out;
+		if (!r->partial) {
+			ring_get(r->mem, dev->size, &hdr, sizeof(hdr), out);
+			out += sizeof(hdr);
+			r->partial = hdr.len;
+		}
+
+		n = min_t(size_t, count - copied, r->partial);
+		left = ring_copy_to_user(r->mem, dev->size, buf + copied, n, out);
+		n -= left;
+		out += n;
+		r->partial -= n;
+		copied += n;
+
+		/* 数据读走之后再发布新的读指针 */
+		smp_store_release(&r->out, out);
+		dev->pcpu_cur = r->partial ? cpu : -1;
+
+		if (left) {
+			if (!copied)
+				ret = -EFAULT;
+			break;
+		}
+	}
+
+	if (copied)
+		ret = copied;
+	pr_debug("pcpu read %zu byte(s)\n", copied);
+
+	/*
+	 * 和写进程睡眠之前的检查配对，没有写进程在等待时不需要唤醒
+	 * 写进程等的是各自CPU上的子环，不是独占等待，全部唤醒
+	 */
+	smp_mb();
+	if (waitqueue_active(&dev->w_wait))
+		wake_up_interruptible_poll(&dev->w_wait, FIFO_POLLOUT);
+
+	/* 可写是按每个CPU的子环判断的，没有统一的边沿，每次读走数据都通知 */
+	if (copied)
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+
+out:
+	mutex_unlock(&dev->mutex);
+
+	/* 还有没读完的数据，把唤醒传给下一个读进程 */
+	if (ret != -EAGAIN)
+		pcpu_wake_readers(dev);
+	return ret;
+}
+
+/* 本CPU的子环中还能写入多少字节的数据(扣除帧头) */
+static inline unsigned int pcpu_avail(struct global_mem_dev *dev, struct globalfifo_pcpu *r)
+{
+	unsigned int avail = dev->size - (READ_ONCE(r->in) - smp_load_acquire(&r->out));
+
+	return avail > sizeof(struct globalfifo_frame) ? avail - sizeof(struct globalfifo_frame) : 0;
+}
+
+/*
+ * PERCPU模式的写：只写当前CPU的子环，一次write是一帧
+ * 一帧不能超过子环的大小，更大的write只写入一部分，和管道一样返回写入的字节数
+ * 拷贝用户数据可能睡眠并且被迁移到别的CPU，这时仍然写原来的子环，只是多了一次跨CPU的访问
+ */
+static ssize_t global_mem_pcpu_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	struct globalfifo_pcpu *r;
+	struct globalfifo_frame hdr;
+	unsigned int in, avail;
+	bool empty;
+	DEFINE_WAIT(wait);
+
+	if (!count)
+		return 0;
+
+	count = min_t(size_t, count, dev->size - sizeof(hdr));
+
+	for (;;) {
+		r = raw_cpu_ptr(dev->pcpu);
+		if (mutex_lock_interruptible(&r->lock))
+			return -ERESTARTSYS;
+
+		/* 阻塞方式等到整帧都能放下，非阻塞方式有空间就写入一部分 */
+		avail = pcpu_avail(dev, r);
+		if (avail >= count || (avail && (filp->f_flags & O_NONBLOCK)))
+			break;
+		mutex_unlock(&r->lock);
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		prepare_to_wait(&dev->w_wait, &wait, TASK_INTERRUPTIBLE);
+		if (pcpu_avail(dev, r) < count)
+			schedule();
+		finish_wait(&dev->w_wait, &wait);
+
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+
+	count = min_t(size_t, count, avail);
+	in = r->in;
+	empty = in == READ_ONCE(r->out);
+
+	/* 先拷贝数据，再填帧头，时间戳尽量接近发布的时刻 */
+	count -= ring_copy_from_user(r->mem, dev->size, buf, count, in + sizeof(hdr));
+	if (!count) {
+		mutex_unlock(&r->lock);
+		return -EFAULT;
+	}
+
+	hdr.ts = ktime_get_ns();
+	hdr.len = count;
+	hdr.pad = 0;
+	ring_put(r->mem, dev->size, &hdr, sizeof(hdr), in);
+
+	smp_store_release(&r->in, in + sizeof(hdr) + count);
+	mutex_unlock(&r->lock);
+	pr_debug("pcpu write %zu byte(s)\n", count);
+
+	/* 读进程不在睡眠时只读一次r_wait，不会写共享的cache line */
+	pcpu_wake_readers(dev);
+
+	/* 子环从空变为非空时通知eventfd，释放SIGIO信号 */
+	if (empty) {
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_READ);
+		if (dev->async_queue)
+			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	}
+
+	return count;
+}
+
+/* 清空所有子环，持有dev->mutex */
+static void global_mem_pcpu_clear(struct global_mem_dev *dev)
+{
+	struct globalfifo_pcpu *r;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		r = per_cpu_ptr(dev->pcpu, cpu);
+		smp_store_release(&r->out, smp_load_acquire(&r->in));
+		r->partial = 0;
+	}
+	dev->pcpu_cur = -1;
+}
+
+static unsigned int global_mem_pcpu_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+	struct global_mem_dev *dev = filp->private_data;
+
+	poll_wait(filp, &dev->r_wait, wait);
+	poll_wait(filp, &dev->w_wait, wait);
+
+	smp_mb();
+	if (pcpu_pending(dev))
+		mask |= POLLIN | POLLRDNORM;
+
+	/* 写进程只写本CPU的子环，只能按当前CPU的子环判断是否可写 */
+	if (pcpu_avail(dev, raw_cpu_ptr(dev->pcpu)))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+static int global_mem_pcpu_alloc(struct global_mem_dev *dev)
+{
+	struct globalfifo_pcpu *r;
+	int cpu;
+
+	dev->pcpu = alloc_percpu(struct globalfifo_pcpu);
+	if (!dev->pcpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		r = per_cpu_ptr(dev->pcpu, cpu);
+		mutex_init(&r->lock);
+		r->mem = kmalloc_node(dev->size, GFP_KERNEL, cpu_to_node(cpu));
+		if (!r->mem)
+			return -ENOMEM;
+	}
+	dev->pcpu_cur = -1;
+
+	return 0;
+}
+
+static void global_mem_pcpu_free(struct global_mem_dev *dev)
+{
+	int cpu;
+
+	if (!dev->pcpu)
+		return;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(dev->pcpu, cpu)->mem);
+	free_percpu(dev->pcpu);
+	dev->pcpu = NULL;
+}
+
+/*
+ * 和poll一致，能写入一个写水位大小的消息才算可写，持有dev->mutex
+ * 记录fifo的kfifo_avail已经扣除了记录头
+ */
+static inline bool rec_writable(struct global_mem_dev *dev)
+{
+	return kfifo_avail(&dev->rec) >= min_t(unsigned int, dev->write_wm, GLOBALFIFO_REC_MAX);
+}
+
+/* 有消息时唤醒一个读进程，被唤醒的读进程没有读走全部消息时也用它传给下一个 */
+static void global_mem_rec_wake_readers(struct global_mem_dev *dev)
+{
+	smp_mb();
+	if (waitqueue_active(&dev->r_wait) && !kfifo_is_empty(&dev->rec))
+		wake_up_interruptible_poll(&dev->r_wait, FIFO_POLLIN);
+}
+
+/*
+ * 记录模式下等待fifo中有消息，成功返回0并且持有dev->mutex
+ * 读进程和写进程都持有dev->mutex操作kfifo，和mutex模式一样
+ */
+static int global_mem_rec_wait(struct global_mem_dev *dev, struct file *filp)
+{
+	DEFINE_WAIT(wait);
+
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&dev->rec)) {
+		if (filp->f_flags & O_NONBLOCK) {
+			mutex_unlock(&dev->mutex);
+			return -EAGAIN;
+		}
+
+		/* 读进程之间独占等待，一条消息只唤醒一个读进程 */
+		prepare_to_wait_exclusive(&dev->r_wait, &wait, TASK_INTERRUPTIBLE);
+		mutex_unlock(&dev->mutex);
+		schedule();
+		finish_wait(&dev->r_wait, &wait);
+
+		if (signal_pending(current) || mutex_lock_interruptible(&dev->mutex)) {
+			global_mem_rec_wake_readers(dev);
+			return -ERESTARTSYS;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * 记录模式的读：一次只读一条完整的消息
+ * 缓冲区放不下下一条消息时返回EMSGSIZE，消息留在fifo中，可以换一个大的缓冲区再读
+ */
+static ssize_t global_mem_rec_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	unsigned int copied;
+	bool writable;
+	ssize_t ret;
+
+	ret = global_mem_rec_wait(dev, filp);
+	if (ret)
+		return ret;
+
+	if (kfifo_peek_len(&dev->rec) > count) {
+		ret = -EMSGSIZE;
+		goto out;
+	}
+
+	writable = rec_writable(dev);
+	ret = kfifo_to_user(&dev->rec, buf, count, &copied);
+	if (!ret)
+		ret = copied;
+	pr_debug("rec read %zd byte(s), len:%u\n", ret, kfifo_len(&dev->rec));
+
+	/*
+	 * 写进程睡眠之前持有过mutex，这里看得到它是否在等待队列中
+	 * 写进程等待的空间大小各不相同，不是独占等待，全部唤醒
+	 */
+	if (waitqueue_active(&dev->w_wait))
+		wake_up_interruptible_poll(&dev->w_wait, FIFO_POLLOUT);
+	if (!writable && rec_writable(dev))
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+
+out:
+	mutex_unlock(&dev->mutex);
+	global_mem_rec_wake_readers(dev);
+	return ret;
+}
+
+/* 记录模式的写：一次write是一条消息，要么整条写入，要么不写 */
+static ssize_t global_mem_rec_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	unsigned int copied;
+	bool empty;
+	ssize_t ret;
+	DEFINE_WAIT(wait);
+
+	/* 长度为0的消息会被读进程当成文件结束，不写入 */
+	if (!count)
+		return 0;
+	if (count > GLOBALFIFO_REC_MAX)
+		return -EMSGSIZE;
+
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+
+	while (kfifo_avail(&dev->rec) < count) {
+		fifo_count_full(dev);
+		if (filp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		prepare_to_wait(&dev->w_wait, &wait, TASK_INTERRUPTIBLE);
+		mutex_unlock(&dev->mutex);
+		schedule();
+		finish_wait(&dev->w_wait, &wait);
+
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+	}
+
+	empty = kfifo_is_empty(&dev->rec);
+	ret = kfifo_from_user(&dev->rec, buf, count, &copied);
+	if (!ret)
+		ret = copied;
+	fifo_update_max(dev, kfifo_len(&dev->rec));
+	pr_debug("rec write %zd byte(s), len:%u\n", ret, kfifo_len(&dev->rec));
+
+	if (ret > 0) {
+		if (waitqueue_active(&dev->r_wait))
+			wake_up_interruptible_poll(&dev->r_wait, FIFO_POLLIN);
+
+		/* fifo从空变为有消息时通知eventfd，释放SIGIO信号 */
+		if (empty) {
+			fifo_signal_event(dev, GLOBALFIFO_EVENT_READ);
+			if (dev->async_queue)
+				kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+		}
+	}
+
+out:
+	mutex_unlock(&dev->mutex);
+	return ret;
+}
+
+/*
+ * FIFO_READ_BATCH：一次ioctl读出尽量多的消息，减少系统调用的次数
+ * 至少要放得下一条消息，否则返回EMSGSIZE
+ */
+static long global_mem_rec_read_batch(struct global_mem_dev *dev, struct file *filp,
+				      struct globalfifo_batch __user *argp)
+{
+	struct globalfifo_batch batch;
+	char __user *p;
+	unsigned int copied, len, off = 0, count = 0;
+	bool writable;
+	__u32 hdr;
+	long ret;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+	p = u64_to_user_ptr(batch.buf);
+
+	ret = global_mem_rec_wait(dev, filp);
+	if (ret)
+		return ret;
+
+	writable = rec_writable(dev);
+	while (!kfifo_is_empty(&dev->rec)) {
+		len = kfifo_peek_len(&dev->rec);
+		if (off + sizeof(hdr) + len > batch.len)
+			break;
+
+		hdr = len;
+		if (copy_to_user(p + off, &hdr, sizeof(hdr)) ||
+		    kfifo_to_user(&dev->rec, p + off + sizeof(hdr), len, &copied)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		off += ALIGN(sizeof(hdr) + len, GLOBALFIFO_REC_ALIGN);
+		count++;
+	}
+
+	if (count && waitqueue_active(&dev->w_wait))
+		wake_up_interruptible_poll(&dev->w_wait, FIFO_POLLOUT);
+	if (!writable && rec_writable(dev))
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+	mutex_unlock(&dev->mutex);
+	global_mem_rec_wake_readers(dev);
+
+	/* 已经读走的消息不能退回fifo，只要读到了消息就返回成功 */
+	if (!count)
+		return ret ? ret : -EMSGSIZE;
+
+	batch.count = count;
+	batch.bytes = min(off, batch.len);
+	if (copy_to_user(argp, &batch, sizeof(batch)))
+		return -EFAULT;
+
+	return count;
+}
+
+static unsigned int global_mem_rec_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+	struct global_mem_dev *dev = filp->private_data;
+
+	poll_wait(filp, &dev->r_wait, wait);
+	poll_wait(filp, &dev->w_wait, wait);
+
+	mutex_lock(&dev->mutex);
+	if (!kfifo_is_empty(&dev->rec))
+		mask |= POLLIN | POLLRDNORM;
+
+	/* 以能不能写入一个写水位大小的消息判断是否可写 */
+	if (rec_writable(dev))
+		mask |= POLLOUT | POLLWRNORM;
+	mutex_unlock(&dev->mutex);
+
+	return mask;
+}
+
+/*
+ * 页模式：fifo是一个页引用的环，每个槽引用一个页中的一段数据，读写都持有dev->mutex
+ * write把数据拷贝到新分配的页中，read从页中拷贝出来，和其他模式一样各拷贝一次；
+ * splice_write从管道中拿走页的引用放到槽中，splice_read把槽中的页放到管道中，都不拷贝数据。
+ * 生产者vmsplice进来的是它自己的用户页，在消费者读走之前不能再修改这些页
+ */
+
+static inline struct globalfifo_page *page_slot(struct global_mem_dev *dev, unsigned int idx)
+{
+	return &dev->pages[idx & (GLOBALFIFO_PAGE_SLOTS - 1)];
+}
+
+static inline bool page_empty(struct global_mem_dev *dev)
+{
+	return dev->page_in == dev->page_out;
+}
+
+static inline bool page_full(struct global_mem_dev *dev)
+{
+	return dev->page_in - dev->page_out == GLOBALFIFO_PAGE_SLOTS;
+}
+
+/* 从头部去掉n字节，槽中的数据用完之后放掉fifo持有的引用，持有dev->mutex */
+static void page_consume(struct global_mem_dev *dev, unsigned int n)
+{
+	struct globalfifo_page *p;
+	unsigned int l;
+
+	dev->page_bytes -= n;
+	while (n) {
+		p = page_slot(dev, dev->page_out);
+		l = min(n, p->len);
+		p->offset += l;
+		p->len -= l;
+		n -= l;
+		if (!p->len) {
+			put_page(p->page);
+			dev->page_out++;
+		}
+	}
+}
+
+/*
+ * 读写进程都是独占等待，每次读写之后调用：还有数据(空槽)就唤醒一个读(写)进程，
+ * 被唤醒的进程没有用完的时候再传给下一个
+ */
+static void page_wake(struct global_mem_dev *dev)
+{
+	unsigned int n;
+
+	smp_mb();
+	n = READ_ONCE(dev->page_in) - READ_ONCE(dev->page_out);
+	if (n && waitqueue_active(&dev->r_wait))
+		wake_up_interruptible_poll(&dev->r_wait, FIFO_POLLIN);
+	if (n < GLOBALFIFO_PAGE_SLOTS && waitqueue_active(&dev->w_wait))
+		wake_up_interruptible_poll(&dev->w_wait, FIFO_POLLOUT);
+}
+
+/* 写入之后调用，fifo从空变为非空时通知eventfd，释放SIGIO信号，持有dev->mutex */
+static void page_notify_readers(struct global_mem_dev *dev, bool was_empty)
+{
+	if (!was_empty || page_empty(dev))
+		return;
+
+	fifo_signal_event(dev, GLOBALFIFO_EVENT_READ);
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+/* 读走之后调用，fifo从满变为有空槽时通知eventfd，持有dev->mutex */
+static void page_notify_writers(struct global_mem_dev *dev, bool was_full)
+{
+	if (was_full && !page_full(dev))
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+}
+
+/*
+ * 页模式下等待fifo非空(write为false)或者有空槽(write为true)，成功返回0并且持有dev->mutex
+ * nonblock来自O_NONBLOCK或者SPLICE_F_NONBLOCK
+ */
+static int global_mem_page_wait(struct global_mem_dev *dev, bool write, bool nonblock)
+{
+	wait_queue_head_t *q = write ? &dev->w_wait : &dev->r_wait;
+	DEFINE_WAIT(wait);
+
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+
+	while (write ? page_full(dev) : page_empty(dev)) {
+		if (write)
+			fifo_count_full(dev);
+		if (nonblock) {
+			mutex_unlock(&dev->mutex);
+			return -EAGAIN;
+		}
+
+		prepare_to_wait_exclusive(q, &wait, TASK_INTERRUPTIBLE);
+		mutex_unlock(&dev->mutex);
+		schedule();
+		finish_wait(q, &wait);
+
+		/* 被唤醒之后不用的话，把唤醒传给下一个 */
+		if (signal_pending(current) || mutex_lock_interruptible(&dev->mutex)) {
+			page_wake(dev);
+			return -ERESTARTSYS;
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t global_mem_page_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	struct globalfifo_page *p;
+	unsigned int l, left;
+	size_t done = 0;
+	bool full;
+	void *vaddr;
+	ssize_t ret;
+
+	if (!count)
+		return 0;
+
+	ret = global_mem_page_wait(dev, false, filp->f_flags & O_NONBLOCK);
+	if (ret)
+		return ret;
+
+	full = page_full(dev);
+	while (done < count && !page_empty(dev)) {
+		p = page_slot(dev, dev->page_out);
+		l = min_t(size_t, count - done, p->len);
+
+		/* splice进来的可能是文件的page cache，在高端内存中 */
+		vaddr = kmap(p->page);
+		left = copy_to_user(buf + done, vaddr + p->offset, l);
+		kunmap(p->page);
+
+		page_consume(dev, l - left);
+		done += l - left;
+		if (left)
+			break;
+	}
+
+	ret = done ? done : -EFAULT;
+	pr_debug("page read %zd byte(s), len:%u\n", ret, dev->page_bytes);
+	page_notify_writers(dev, full);
+	mutex_unlock(&dev->mutex);
+	page_wake(dev);
+	return ret;
+}
+
+static ssize_t global_mem_page_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	struct globalfifo_page *p;
+	unsigned int l, left;
+	struct page *page;
+	size_t done = 0;
+	bool empty;
+	ssize_t ret;
+
+	if (!count)
+		return 0;
+
+	ret = global_mem_page_wait(dev, true, filp->f_flags & O_NONBLOCK);
+	if (ret)
+		return ret;
+
+	empty = page_empty(dev);
+	while (done < count) {
+		/* 小块的写先填满最后一个自己分配的页，不是每次write都占一个槽 */
+		p = page_empty(dev) ? NULL : page_slot(dev, dev->page_in - 1);
+		if (!p || !p->own || p->offset + p->len == PAGE_SIZE) {
+			if (page_full(dev))
+				break;
+			page = alloc_page(GFP_KERNEL);
+			if (!page) {
+				ret = -ENOMEM;
+				break;
+			}
+			p = page_slot(dev, dev->page_in);
+			p->page = page;
+			p->offset = 0;
+			p->len = 0;
+			p->own = true;
+			dev->page_in++;
+		}
+
+		l = min_t(size_t, count - done, PAGE_SIZE - p->offset - p->len);
+		left = copy_from_user(page_address(p->page) + p->offset + p->len, buf + done, l);
+		p->len += l - left;
+		dev->page_bytes += l - left;
+		done += l - left;
+
+		if (left) {
+			/* 新分配的页一个字节也没有写进去，不能留一个空槽给读进程 */
+			if (!p->len) {
+				put_page(p->page);
+				dev->page_in--;
+			}
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+	if (done)
+		ret = done;
+	fifo_update_max(dev, dev->page_bytes);
+	pr_debug("page write %zd byte(s), len:%u\n", ret, dev->page_bytes);
+	page_notify_readers(dev, empty);
+	mutex_unlock(&dev->mutex);
+	page_wake(dev);
+	return ret;
+}
+
+/* splice_to_pipe没有放进管道的页由它调用这个函数放掉引用 */
+static void global_mem_page_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * splice_read：增加槽中页的引用计数放到管道中，不拷贝数据
+ * 调用者持有管道的锁，管道放不下的部分留在fifo中
+ * 页可能还在fifo中被write接着写，所以用nosteal，不允许管道的读者拿走整个页
+ */
+static ssize_t global_mem_page_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+					   size_t len, unsigned int flags)
+{
+	struct global_mem_dev *dev = in->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &nosteal_pipe_buf_ops,
+		.spd_release = global_mem_page_spd_release,
+	};
+	struct globalfifo_page *p;
+	unsigned int idx, l;
+	bool full;
+	ssize_t ret;
+
+	if (!len)
+		return 0;
+
+	ret = global_mem_page_wait(dev, false, (in->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK));
+	if (ret)
+		return ret;
+
+	for (idx = dev->page_out; idx != dev->page_in && spd.nr_pages < PIPE_DEF_BUFFERS && len; idx++) {
+		p = page_slot(dev, idx);
+		l = min_t(size_t, len, p->len);
+		get_page(p->page);
+		pages[spd.nr_pages] = p->page;
+		partial[spd.nr_pages].offset = p->offset;
+		partial[spd.nr_pages].len = l;
+		partial[spd.nr_pages].private = 0;
+		spd.nr_pages++;
+		len -= l;
+	}
+
+	full = page_full(dev);
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0)
+		page_consume(dev, ret);
+	pr_debug("page splice_read %zd byte(s), len:%u\n", ret, dev->page_bytes);
+	page_notify_writers(dev, full);
+	mutex_unlock(&dev->mutex);
+	page_wake(dev);
+	return ret;
+}
+
+/* splice_from_pipe对管道中的每个缓冲区调用一次，拿一个页的引用放到fifo的槽中 */
+static int pipe_to_globalfifo(struct pipe_inode_info *pipe, struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct global_mem_dev *dev = sd->u.file->private_data;
+	struct globalfifo_page *p;
+	bool empty;
+
+	mutex_lock(&dev->mutex);
+	if (page_full(dev)) {
+		mutex_unlock(&dev->mutex);
+		return -EAGAIN;
+	}
+
+	empty = page_empty(dev);
+	get_page(buf->page);
+	p = page_slot(dev, dev->page_in);
+	p->page = buf->page;
+	p->offset = buf->offset;
+	p->len = sd->len;
+	p->own = false;
+	dev->page_in++;
+	dev->page_bytes += sd->len;
+	fifo_update_max(dev, dev->page_bytes);
+	page_notify_readers(dev, empty);
+	mutex_unlock(&dev->mutex);
+
+	page_wake(dev);
+	return sd->len;
+}
+
+/*
+ * splice_write：生产者vmsplice到管道中的页直接挂到fifo上
+ * splice_from_pipe持有管道的锁调用pipe_to_globalfifo，先不持有管道的锁等到有空槽，
+ * 否则fifo满的时候往管道里写的生产者也会被卡住；空槽被别的写进程抢走了就再等
+ */
+static ssize_t global_mem_page_splice_write(struct pipe_inode_info *pipe, struct file *out, loff_t *ppos,
+					    size_t len, unsigned int flags)
+{
+	struct global_mem_dev *dev = out->private_data;
+	bool nonblock = (out->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+	ssize_t ret;
+
+	for (;;) {
+		ret = global_mem_page_wait(dev, true, nonblock);
+		if (ret)
+			return ret;
+		mutex_unlock(&dev->mutex);
+
+		ret = splice_from_pipe(pipe, out, ppos, len, flags, pipe_to_globalfifo);
+		if (ret != -EAGAIN || nonblock)
+			return ret;
+	}
+}
+
+static unsigned int global_mem_page_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+	struct global_mem_dev *dev = filp->private_data;
+
+	poll_wait(filp, &dev->r_wait, wait);
+	poll_wait(filp, &dev->w_wait, wait);
+
+	mutex_lock(&dev->mutex);
+	if (!page_empty(dev))
+		mask |= POLLIN | POLLRDNORM;
+	if (!page_full(dev))
+		mask |= POLLOUT | POLLWRNORM;
+	mutex_unlock(&dev->mutex);
+
+	return mask;
+}
+
+/* 放掉fifo中所有页的引用，已经放到管道中的页由管道放掉自己的引用 */
+static void global_mem_page_clear(struct global_mem_dev *dev)
+{
+	page_consume(dev, dev->page_bytes);
+}
+
+static void global_mem_page_free(struct global_mem_dev *dev)
+{
+	if (!dev->pages)
+		return;
+
+	global_mem_page_clear(dev);
+	kfree(dev->pages);
+	dev->pages = NULL;
+}
+
+/*
+ * FIFO_SET_SIZE：在线修改fifo的大小，持有mutex把数据搬到新的缓冲区
+ * in和out都不变，数据按原来的下标放到新缓冲区中对应的位置，广播模式下各个读者的读指针也不用改
+ * 新的缓冲区单独分配，控制页不变，不持有mutex的poll和唤醒只访问控制页中的指针，不会访问到释放的内存
+ * SPSC模式的读写不持有mutex并且可以mmap，PERCPU和记录模式有自己的缓冲区，都不支持
+ */
+static int global_mem_resize(struct global_mem_dev *dev, unsigned int size)
+{
+	unsigned int in, out, len, old_size, n, l, from, to;
+	unsigned char *mem, *old;
+
+	if (dev->mode != GLOBALFIFO_MUTEX && dev->mode != GLOBALFIFO_BCAST)
+		return -EOPNOTSUPP;
+	if (!is_power_of_2(size) || size < GLOBALFIFO_MIN_SIZE || size > GLOBALFIFO_MAX_SIZE)
+		return -EINVAL;
+
+	mem = kvmalloc(size, GFP_KERNEL);
+	if (!mem)
+		return -ENOMEM;
 
-#define GLOBALMEM_SIZE 4096
-#define DEVICE_NUM 4
-#define GLOBAL_MEM_MAGIC 'g'
-#define MEM_CLEAR _IO(GLOBAL_MEM_MAGIC, 0)
+	mutex_lock(&dev->mutex);
+	in = dev->ring->in;
+	out = dev->ring->out;
+	len = in - out;
+	old_size = dev->size;
 
-static struct class *globalmem_class;
-static char *chr_dev_name[20] = {"global_mem_0", "global_mem_1", "global_mem_2", "global_mem_3"};
+	/* 缩小时要放得下fifo中现有的数据 */
+	if (len > size) {
+		mutex_unlock(&dev->mutex);
+		kvfree(mem);
+		return -EBUSY;
+	}
 
-struct global_mem_dev {
-	struct cdev cdev;
-	unsigned char mem[GLOBALMEM_SIZE];
-	int current_len;			/* 表示当前在fifo中剩余的长度 */
-	struct mutex mutex;
-	wait_queue_head_t r_wait;	/* 读等待队列 */
-	wait_queue_head_t w_wait;	/* 写等待队列 */
-	struct fasync_struct *async_queue;
-};
+	/* 每次拷贝到新旧缓冲区中先回绕的那一边为止 */
+	for (n = 0; n < len; n += l) {
+		from = (out + n) & (old_size - 1);
+		to = (out + n) & (size - 1);
+		l = min3(len - n, old_size - from, size - to);
+		memcpy(mem + to, dev->mem + from, l);
+	}
 
-struct global_mem_dev *global_mem_devp;
+	old = dev->mem_alloc;
+	dev->mem = mem;
+	dev->mem_alloc = mem;
+	WRITE_ONCE(dev->size, size);
+	dev->ring->size = size;
+	mutex_unlock(&dev->mutex);
 
-dev_t devno; /* 为了在init和exit函数中使用，要用到全局变量 */
+	kvfree(old);
+	printk(KERN_INFO "globalfifo resized from %u to %u, len:%u\n", old_size, size, len);
 
-static int global_mem_fasync(int fd, struct file *filp, int mode)
+	/* 变大之后空间多了，唤醒的写进程会把唤醒传给下一个 */
+	if (size > old_size) {
+		wake_up_interruptible_poll(&dev->w_wait, FIFO_POLLOUT);
+		if (old_size - len < fifo_write_wm(dev) && size - len >= fifo_write_wm(dev))
+			fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+	}
+
+	return 0;
+}
+
+static long global_mem_size_ioctl(struct global_mem_dev *dev, unsigned int cmd, unsigned long args)
 {
-	struct global_mem_dev *dev = filp->private_data;
-	return fasync_helper(fd, filp, mode, &dev->async_queue);
+	struct globalfifo_stats stats;
+	__u32 size;
+
+	switch (cmd) {
+	case FIFO_SET_SIZE:
+		if (get_user(size, (__u32 __user *)args))
+			return -EFAULT;
+
+		return global_mem_resize(dev, size);
+	case FIFO_GET_STATS:
+		memset(&stats, 0, sizeof(stats));
+		stats.size = dev->mode == GLOBALFIFO_PAGE ? GLOBALFIFO_PAGE_SLOTS * PAGE_SIZE : READ_ONCE(dev->size);
+		stats.max_len = READ_ONCE(dev->max_len);
+		stats.full = READ_ONCE(dev->full);
+		if (dev->mode == GLOBALFIFO_RECORD)
+			stats.len = kfifo_len(&dev->rec);
+		else if (dev->mode == GLOBALFIFO_PAGE)
+			stats.len = READ_ONCE(dev->page_bytes);
+		else if (dev->mode != GLOBALFIFO_PERCPU)
+			stats.len = fifo_len(dev);
+
+		if (copy_to_user((void __user *)args, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	case FIFO_RESET_STATS:
+		mutex_lock(&dev->mutex);
+		WRITE_ONCE(dev->max_len, 0);
+		WRITE_ONCE(dev->full, 0);
+		mutex_unlock(&dev->mutex);
+		return 0;
+	}
+
+	return -EINVAL;
 }
 
-int global_mem_open(struct inode *inode, struct file *filp)
+/*
+ * 广播模式：写进程只写一份数据，每个读者从自己的读指针读，读走的数据不影响其他读者
+ * 读写都持有dev->mutex，ring->in是写指针，ring->out是最慢的读者的读指针
+ */
+
+/* 重新计算最慢的读者，返回空间是否增加了；没有读者时数据直接丢弃 */
+static bool bcast_update_tail(struct global_mem_dev *dev)
+{
+	struct globalfifo_reader *r;
+	unsigned int in = dev->ring->in, lag = 0;
+	unsigned int old = dev->ring->out;
+
+	/* 读指针只增不减，用in - out比较快慢，回绕之后也是对的 */
+	list_for_each_entry(r, &dev->readers, list)
+		lag = max(lag, in - r->out);
+
+	dev->ring->out = in - lag;
+	return dev->ring->out != old;
+}
+
+/* 丢弃落后超过limit字节的读者，把它们的读指针移到in */
+static void bcast_drop_readers(struct global_mem_dev *dev, unsigned int limit)
+{
+	struct globalfifo_reader *r;
+	unsigned int in = dev->ring->in;
+
+	list_for_each_entry(r, &dev->readers, list) {
+		if (in - r->out > limit) {
+			r->out = in;
+			r->dropped = true;
+			pr_debug("bcast drop reader %p\n", r);
+		}
+	}
+	bcast_update_tail(dev);
+}
+
+/*
+ * 最慢的读者前进之后调用，old_avail是前进之前的空间，持有dev->mutex
+ * 唤醒等待空间的写进程，从不可写变为可写时通知eventfd
+ */
+static void bcast_space_freed(struct global_mem_dev *dev, unsigned int old_avail)
+{
+	unsigned int wm = fifo_write_wm(dev);
+
+	if (waitqueue_active(&dev->w_wait))
+		wake_up_interruptible_poll(&dev->w_wait, FIFO_POLLOUT);
+
+	/* 丢弃策略下一直是可写的 */
+	if (!dev->drop && old_avail < wm && fifo_avail(dev) >= wm)
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+}
+
+static int global_mem_bcast_open(struct inode *inode, struct file *filp)
 {
-	/* 在设备驱动中默认将设备指针挂接在文件的私有数据中，在后续只需要对文件的私有数据进行操作即可 */
-	//filp->private_data = global_mem_devp;
 	struct global_mem_dev *dev = container_of(inode->i_cdev, struct global_mem_dev, cdev);
-	filp->private_data = dev;
+	struct globalfifo_reader *r;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+
+	r->dev = dev;
+	INIT_LIST_HEAD(&r->list);
+	filp->private_data = r;
+
+	/* 新的读者只读打开之后写入的数据 */
+	if (filp->f_mode & FMODE_READ) {
+		mutex_lock(&dev->mutex);
+		r->out = dev->ring->in;
+		list_add_tail(&r->list, &dev->readers);
+		mutex_unlock(&dev->mutex);
+	}
 
 	return 0;
 }
 
-int global_mem_release(struct inode *inode, struct file *filp)
+static int global_mem_bcast_fasync(int fd, struct file *filp, int mode)
 {
-	/* 将文件从异步通知列表中删除 */
-	global_mem_fasync(-1, filp, 0);
-	return 0;
+	struct globalfifo_reader *r = filp->private_data;
+
+	return fasync_helper(fd, filp, mode, &r->dev->async_queue);
 }
 
-static ssize_t global_mem_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+static int global_mem_bcast_release(struct inode *inode, struct file *filp)
 {
-	int ret = 0;
-	struct global_mem_dev *dev = filp->private_data;
+	struct globalfifo_reader *r = filp->private_data;
+	struct global_mem_dev *dev = r->dev;
+	unsigned int avail;
 
-	/* 申请等待队列wait */
-	DECLARE_WAITQUEUE(wait, current);
+	global_mem_bcast_fasync(-1, filp, 0);
+	global_mem_event_release(dev, filp);
 
+	/* 最慢的读者关闭之后空间变多了，唤醒等待的写进程 */
 	mutex_lock(&dev->mutex);
-	add_wait_queue(&dev->r_wait, &wait);
+	list_del(&r->list);
+	avail = fifo_avail(dev);
+	if (bcast_update_tail(dev))
+		bcast_space_freed(dev, avail);
+	mutex_unlock(&dev->mutex);
 
-	/* 判断FIFO 是否为0，如果为空则不能读取了，需要等待写进程增加current_len   */
-	while (dev->current_len == 0) {
-		/* 非阻塞方式:
-		 * 直接返回EAGIAN，释放mutex 
-		 */
+	kfree(r);
+	return 0;
+}
+
+static ssize_t global_mem_bcast_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct globalfifo_reader *r = filp->private_data;
+	struct global_mem_dev *dev = r->dev;
+	unsigned int len, avail;
+	ssize_t ret;
+	DEFINE_WAIT(wait);
+
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+
+	/* 每个读者等的是自己的读指针，不是独占等待，写入之后全部唤醒 */
+	while (!r->dropped && r->out == dev->ring->in) {
 		if (filp->f_flags & O_NONBLOCK) {
 			ret = -EAGAIN;
 			goto out;
 		}
 
-		/* 阻塞方式:
-		 * 需要讲进程状态设置为TASK_INTERRRUPTIBLE，可以被信号唤醒，即所谓的浅度睡眠
-		 * 释放mutex，调用schedule()，调取其他进程。
-		 */
-		printk("globelmem read before schedule.\n");
-		__set_current_state(TASK_INTERRUPTIBLE);
-		/* 在把自己切换出去 时，要释放锁，以便读进程可以拿到 */
-		mutex_unlock(&dev->mutex); 
+		prepare_to_wait(&dev->r_wait, &wait, TASK_INTERRUPTIBLE);
+		mutex_unlock(&dev->mutex);
 		schedule();
+		finish_wait(&dev->r_wait, &wait);
 
-		/* 如果是因为被信号唤醒了，则返回ERESTARTSYS 将r_wait移除队列，
-		 * 并且把进程状态设置为TASK_RUNNING 
-		 */
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out2;
-		}
-
-		/* 
-		 * 再次进入的时候，需要再次获得锁，这里对应的是unlock可能是schedule之前的
-		 * 也可能是最后返回时的锁	
-		 */
-		mutex_lock(&dev->mutex);
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
 	}
 
-	if (count > dev->current_len) {
-		count = dev->current_len;
+	/* 被丢弃的读者先得到一次EPIPE，知道中间丢了数据，之后从新的位置继续读 */
+	if (r->dropped) {
+		r->dropped = false;
+		ret = -EPIPE;
+		goto out;
 	}
-	
-	if (copy_to_user(buf, dev->mem, count)) {
+
+	len = dev->ring->in - r->out;
+	if (count > len)
+		count = len;
+
+	count -= fifo_copy_to_user(dev, buf, count, r->out);
+	if (!count) {
 		ret = -EFAULT;
 		goto out;
-	} else {
-		/* 将剩下的数据移动到fifo的头部 */
-		memcpy(dev->mem, dev->mem + count, dev->current_len - count);
-		dev->current_len -= count;
-		printk(KERN_INFO "read %lu byte(s), current_len:%d\n", count, dev->current_len);
+	}
 
-		/* 读进程完成，唤醒可能阻塞的写进程 */
-		wake_up_interruptible(&dev->w_wait);
+	r->out += count;
+	ret = count;
+	pr_debug("bcast read %zu byte(s), len:%u\n", count, dev->ring->in - r->out);
 
-		ret = count;
-	}
+	/* 最慢的读者前进之后才有新的空间 */
+	avail = fifo_avail(dev);
+	if (bcast_update_tail(dev))
+		bcast_space_freed(dev, avail);
 
 out:
 	mutex_unlock(&dev->mutex);
-
-out2:
-	remove_wait_queue(&dev->r_wait, &wait);
-	set_current_state(TASK_RUNNING);
-	
 	return ret;
-
 }
 
-static ssize_t global_mem_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+static ssize_t global_mem_bcast_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
 {
-	int ret = 0;
-	struct global_mem_dev *dev = filp->private_data;
-	DECLARE_WAITQUEUE(wait, current);	/* 定义等待队列wait */
-
-	mutex_lock(&dev->mutex);
-	add_wait_queue(&dev->w_wait, &wait);	/* 添加w_wait到等待队列wait */
+	struct globalfifo_reader *r = filp->private_data;
+	struct global_mem_dev *dev = r->dev;
+	unsigned int in;
+	ssize_t ret;
+	DEFINE_WAIT(wait);
+
+	if (!count)
+		return 0;
+
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+
+	/* 丢弃策略下写进程从不等待，把放不下这次数据的读者丢掉 */
+	if (dev->drop && fifo_avail(dev) < min_t(size_t, count, dev->size)) {
+		fifo_count_full(dev);
+		bcast_drop_readers(dev, dev->size - min_t(size_t, count, dev->size));
+	}
 
-	while (dev->current_len == GLOBALMEM_SIZE) {
-		if (filp->f_flags &O_NONBLOCK) {
+	while (!dev->drop && fifo_avail(dev) < fifo_write_wm(dev)) {
+		fifo_count_full(dev);
+		if (filp->f_flags & O_NONBLOCK) {
+			if (fifo_avail(dev))
+				break;
 			ret = -EAGAIN;
 			goto out;
 		}
 
-		printk("globelmem write before schedule.\n");
-		__set_current_state(TASK_INTERRUPTIBLE);
+		prepare_to_wait(&dev->w_wait, &wait, TASK_INTERRUPTIBLE);
 		mutex_unlock(&dev->mutex);
-		/* 把自己切换出去 */
 		schedule();
+		finish_wait(&dev->w_wait, &wait);
 
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out2;
-		}
-
-		mutex_lock(&dev->mutex);
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
 	}
 
-	if (count > GLOBALMEM_SIZE - dev->current_len)
-		count = GLOBALMEM_SIZE - dev->current_len;
+	if (count > fifo_avail(dev))
+		count = fifo_avail(dev);
 
-	if (copy_from_user(dev->mem + dev->current_len, buf, count)) {
+	in = dev->ring->in;
+	count -= fifo_copy_from_user(dev, buf, count, in);
+	if (!count) {
 		ret = -EFAULT;
 		goto out;
-	} else {
-		dev->current_len += count;
-		printk(KERN_INFO "write %lu byte(s) current_len:%d\n", count, dev->current_len);
+	}
 
-		/* 写进程完成了，唤醒可能阻塞的读进程 */
-		wake_up_interruptible(&dev->r_wait);
+	dev->ring->in = in + count;
+	fifo_update_max(dev, fifo_len(dev));
+	ret = count;
+	pr_debug("bcast write %zu byte(s)\n", count);
 
-		/* 当设备被正确写入之后，它变得可读，释放SIGIO信号*/
-		if (dev->async_queue) {
-			printk(KERN_INFO "enter the async_queue write over\n");
-			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-			printk(KERN_INFO "%s kill SIGIO\n", __func__);
-		}
+	/* 没有读者时数据没有人要，直接丢弃 */
+	if (list_empty(&dev->readers))
+		dev->ring->out = dev->ring->in;
+
+	/* 所有读者都要读这份数据，全部唤醒 */
+	if (waitqueue_active(&dev->r_wait))
+		wake_up_interruptible_poll(&dev->r_wait, FIFO_POLLIN);
+
+	/* 每个读者的读指针不同，没有统一的边沿，每次写入都通知 */
+	fifo_signal_event(dev, GLOBALFIFO_EVENT_READ);
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
 
-		ret = count;
-	}
-	
 out:
 	mutex_unlock(&dev->mutex);
-out2:
-	remove_wait_queue(&dev->w_wait, &wait);
-	set_current_state(TASK_RUNNING);
-	
 	return ret;
 }
 
+static unsigned int global_mem_bcast_poll(struct file *filp, poll_table *wait)
+{
+	struct globalfifo_reader *r = filp->private_data;
+	struct global_mem_dev *dev = r->dev;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &dev->r_wait, wait);
+	poll_wait(filp, &dev->w_wait, wait);
+
+	mutex_lock(&dev->mutex);
+	if ((filp->f_mode & FMODE_READ) && (r->dropped || r->out != dev->ring->in))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (dev->drop || fifo_avail(dev) >= fifo_write_wm(dev))
+		mask |= POLLOUT | POLLWRNORM;
+	mutex_unlock(&dev->mutex);
+
+	return mask;
+}
+
+static long global_mem_bcast_ioctl(struct file *filp, unsigned int cmd, unsigned long args)
+{
+	struct globalfifo_reader *r = filp->private_data;
+	struct global_mem_dev *dev = r->dev;
+	unsigned int avail;
+
+	switch (cmd) {
+	case MEM_CLEAR:
+		break;
+	case FIFO_SET_EVENTFD:
+		return global_mem_set_eventfd(dev, filp, args);
+	case FIFO_SET_SIZE:
+	case FIFO_GET_STATS:
+	case FIFO_RESET_STATS:
+		return global_mem_size_ioctl(dev, cmd, args);
+	default:
+		return -EINVAL;
+	}
+
+	/* 广播模式下MEM_CLEAR只跳过自己还没有读的数据，不影响其他读者 */
+	if (!(filp->f_mode & FMODE_READ))
+		return -EPERM;
+
+	mutex_lock(&dev->mutex);
+	r->out = dev->ring->in;
+	r->dropped = false;
+	avail = fifo_avail(dev);
+	if (bcast_update_tail(dev))
+		bcast_space_freed(dev, avail);
+	mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+/*
+ * 门铃：用户空间的生产者(消费者)移动了指针之后，发现对端可能在睡眠，
+ * 通过ioctl通知内核唤醒等待队列，并发送SIGIO
+ */
+static void global_mem_doorbell(struct global_mem_dev *dev)
+{
+	struct globalfifo_ring *ring = dev->ring;
+	unsigned int len;
+
+	smp_mb();
+	len = smp_load_acquire(&ring->in) - smp_load_acquire(&ring->out);
+
+	/* 和内核中的读写一样，数据(空间)达到水位才唤醒对端 */
+	if (len >= fifo_read_wm(dev) && READ_ONCE(ring->read_wakeup)) {
+		fifo_wake(dev, GLOBALFIFO_EVENT_READ);
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_READ);
+		if (dev->async_queue)
+			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	}
+
+	if (dev->size - len >= fifo_write_wm(dev) && READ_ONCE(ring->write_wakeup)) {
+		fifo_wake(dev, GLOBALFIFO_EVENT_WRITE);
+		fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+	}
+}
+
+/*
+ * poll不持有mutex，SPSC模式下读写进程也不持有mutex。
+ * poll_wait先把自己加到等待队列，smp_mb之后再检查读写指针，
+ * 和读写进程修改指针之后的smp_mb配对，不会错过唤醒
+ */
 static unsigned int global_mem_poll(struct file *filp, poll_table *wait)
 {
 	unsigned int mask =0;
 	struct global_mem_dev *dev = filp->private_data;
-
-	mutex_lock(&dev->mutex);
+	struct globalfifo_ring *ring = dev->ring;
+	unsigned int len;
 
 	poll_wait(filp, &dev->r_wait, wait);
 	poll_wait(filp, &dev->w_wait, wait);
 
-	if (dev->current_len != 0) {
+	/* SPSC模式下对端可能在用户空间，要告诉它移动指针之后需要敲门铃 */
+	if (dev->mode == GLOBALFIFO_SPSC && !poll_does_not_wait(wait)) {
+		WRITE_ONCE(ring->read_wakeup, 1);
+		WRITE_ONCE(ring->write_wakeup, 1);
+	}
+
+	smp_mb();
+	len = READ_ONCE(ring->in) - READ_ONCE(ring->out);
+
+	/* 可读可写的判断和读写进程的唤醒条件一致，都以水位为准 */
+	if (len >= fifo_read_wm(dev)) {
 		mask |= POLLIN | POLLRDNORM;
 	}
 
-	if (dev->current_len != GLOBALMEM_SIZE) {
+	if (dev->size - len >= fifo_write_wm(dev)) {
 		mask |= POLLOUT | POLLWRNORM;
 	}
 
-	mutex_unlock(&dev->mutex);
-
 	return mask;
 }
 
+/*
+ * 把控制页和环形缓冲区一起映射到用户空间，偏移0是控制页，data_offset开始是数据区
+ * remap_vmalloc_range会检查映射的范围，并且设置VM_DONTEXPAND | VM_DONTDUMP
+ */
+static int global_mem_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct global_mem_dev *dev = filp->private_data;
+
+	return remap_vmalloc_range(vma, dev->ring, vma->vm_pgoff);
+}
+
 static loff_t global_mem_llseek(struct file * filp, loff_t offset, int orig)
 {
 	loff_t ret = 0;
@@ -261,14 +2165,92 @@ long global_mem_ioctl(struct file *filp, unsigned int cmd, unsigned long args)
 {
 	long ret = 0;
 	struct global_mem_dev *dev = filp->private_data;
+	struct globalfifo_watermark wm;
+	unsigned int in, len;
+	bool writable;
 	
 	switch (cmd){
 	case MEM_CLEAR:
+		/* SPSC模式下读指针属于唯一的读者，只有它可以清空fifo */
+		if (dev->mode == GLOBALFIFO_SPSC && !fifo_claim(&dev->reader, filp))
+			return -EPERM;
+
+		/*
+		 * 清空fifo只需要把读指针移到写指针的位置，再唤醒等待空间的写进程
+		 * SPSC模式下写者不持有mutex，只能移动读指针，不能修改写指针
+		 */
 		mutex_lock(&dev->mutex);
-		memset(dev->mem, 0, GLOBALMEM_SIZE);
+		if (dev->mode == GLOBALFIFO_PERCPU) {
+			global_mem_pcpu_clear(dev);
+			fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+		} else if (dev->mode == GLOBALFIFO_PAGE) {
+			writable = !page_full(dev);
+			global_mem_page_clear(dev);
+			if (!writable)
+				fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+		} else if (dev->mode == GLOBALFIFO_RECORD) {
+			writable = rec_writable(dev);
+			kfifo_reset_out(&dev->rec);
+			if (!writable)
+				fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+		} else {
+			in = smp_load_acquire(&dev->ring->in);
+			len = in - dev->ring->out;
+			smp_store_release(&dev->ring->out, in);
+			if (dev->size - len < fifo_write_wm(dev))
+				fifo_signal_event(dev, GLOBALFIFO_EVENT_WRITE);
+		}
+		wake_up_interruptible_poll(&dev->w_wait, FIFO_POLLOUT);
 		mutex_unlock(&dev->mutex);
 		printk(KERN_INFO "global mem is set to zero\n");
 		break;
+	case FIFO_DOORBELL:
+		if (dev->mode != GLOBALFIFO_SPSC)
+			return -EINVAL;
+
+		global_mem_doorbell(dev);
+		break;
+	case FIFO_READ_BATCH:
+		if (dev->mode != GLOBALFIFO_RECORD)
+			return -EINVAL;
+
+		return global_mem_rec_read_batch(dev, filp, (struct globalfifo_batch __user *)args);
+	case FIFO_SET_SIZE:
+	case FIFO_GET_STATS:
+	case FIFO_RESET_STATS:
+		return global_mem_size_ioctl(dev, cmd, args);
+	case FIFO_SET_EVENTFD:
+		return global_mem_set_eventfd(dev, filp, args);
+	case FIFO_SET_WATERMARK:
+		/*
+		 * PERCPU模式的数据分散在各个子环中，不支持水位
+		 * 记录模式以整条消息为单位读写，只用写水位判断poll是否可写
+		 */
+		if (dev->mode == GLOBALFIFO_PERCPU || dev->mode == GLOBALFIFO_PAGE)
+			return -EINVAL;
+		if (copy_from_user(&wm, (void __user *)args, sizeof(wm)))
+			return -EFAULT;
+		if (!wm.read_wm || wm.read_wm > dev->size ||
+		    !wm.write_wm || wm.write_wm > dev->size)
+			return -EINVAL;
+
+		mutex_lock(&dev->mutex);
+		WRITE_ONCE(dev->read_wm, wm.read_wm);
+		WRITE_ONCE(dev->write_wm, wm.write_wm);
+		WRITE_ONCE(dev->ring->read_wm, wm.read_wm);
+		WRITE_ONCE(dev->ring->write_wm, wm.write_wm);
+		mutex_unlock(&dev->mutex);
+
+		/* 水位降低之后，正在等待的读写进程可能已经满足条件，唤醒的进程会继续往下传 */
+		wake_up_interruptible_poll(&dev->r_wait, FIFO_POLLIN);
+		wake_up_interruptible_poll(&dev->w_wait, FIFO_POLLOUT);
+		break;
+	case FIFO_GET_WATERMARK:
+		wm.read_wm = READ_ONCE(dev->read_wm);
+		wm.write_wm = READ_ONCE(dev->write_wm);
+		if (copy_to_user((void __user *)args, &wm, sizeof(wm)))
+			return -EFAULT;
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -288,6 +2270,78 @@ struct file_operations global_mem_fops = {
 	.fasync = global_mem_fasync,
 };
 
+struct file_operations global_mem_spsc_fops = {
+	.owner = THIS_MODULE,
+	.open = global_mem_open,
+	.release = global_mem_release,
+	.read = global_mem_spsc_read,
+	.write = global_mem_spsc_write,
+	.unlocked_ioctl = global_mem_ioctl,
+	.llseek = global_mem_llseek,
+	.poll = global_mem_poll,
+	.fasync = global_mem_fasync,
+	.mmap = global_mem_mmap,
+};
+
+struct file_operations global_mem_pcpu_fops = {
+	.owner = THIS_MODULE,
+	.open = global_mem_open,
+	.release = global_mem_release,
+	.read = global_mem_pcpu_read,
+	.write = global_mem_pcpu_write,
+	.unlocked_ioctl = global_mem_ioctl,
+	.llseek = global_mem_llseek,
+	.poll = global_mem_pcpu_poll,
+	.fasync = global_mem_fasync,
+};
+
+struct file_operations global_mem_rec_fops = {
+	.owner = THIS_MODULE,
+	.open = global_mem_open,
+	.release = global_mem_release,
+	.read = global_mem_rec_read,
+	.write = global_mem_rec_write,
+	.unlocked_ioctl = global_mem_ioctl,
+	.llseek = global_mem_llseek,
+	.poll = global_mem_rec_poll,
+	.fasync = global_mem_fasync,
+};
+
+struct file_operations global_mem_bcast_fops = {
+	.owner = THIS_MODULE,
+	.open = global_mem_bcast_open,
+	.release = global_mem_bcast_release,
+	.read = global_mem_bcast_read,
+	.write = global_mem_bcast_write,
+	.unlocked_ioctl = global_mem_bcast_ioctl,
+	.llseek = no_llseek,
+	.poll = global_mem_bcast_poll,
+	.fasync = global_mem_bcast_fasync,
+};
+
+struct file_operations global_mem_page_fops = {
+	.owner = THIS_MODULE,
+	.open = global_mem_open,
+	.release = global_mem_release,
+	.read = global_mem_page_read,
+	.write = global_mem_page_write,
+	.splice_read = global_mem_page_splice_read,
+	.splice_write = global_mem_page_splice_write,
+	.unlocked_ioctl = global_mem_ioctl,
+	.llseek = global_mem_llseek,
+	.poll = global_mem_page_poll,
+	.fasync = global_mem_fasync,
+};
+
+static const struct file_operations *global_mem_mode_fops[] = {
+	[GLOBALFIFO_MUTEX] = &global_mem_fops,
+	[GLOBALFIFO_SPSC] = &global_mem_spsc_fops,
+	[GLOBALFIFO_PERCPU] = &global_mem_pcpu_fops,
+	[GLOBALFIFO_RECORD] = &global_mem_rec_fops,
+	[GLOBALFIFO_BCAST] = &global_mem_bcast_fops,
+	[GLOBALFIFO_PAGE] = &global_mem_page_fops,
+};
+
 static int __init global_mem_probe(struct platform_device *pdev)
 {
 	int ret = 0;
@@ -309,12 +2363,76 @@ static int __init global_mem_probe(struct platform_device *pdev)
 	}
 
 	/* 将设备注册到内核 在c语言中->优先级高于&*/
+	BUILD_BUG_ON(!is_power_of_2(GLOBALMEM_SIZE));
+	BUILD_BUG_ON(sizeof(struct globalfifo_ring) > PAGE_SIZE);
+	BUILD_BUG_ON(!is_power_of_2(GLOBALFIFO_PAGE_SLOTS));
+	BUILD_BUG_ON(GLOBALFIFO_REC_MAX != GLOBALMEM_SIZE - 2);
 	global_mem_devp_tmp = global_mem_devp;
+	for (i = 0; i < DEVICE_NUM; i++) {
+		if (fifo_mode[i] < GLOBALFIFO_MUTEX || fifo_mode[i] > GLOBALFIFO_PAGE) {
+			printk(KERN_INFO "Bad fifo mode %d, using mutex\n", fifo_mode[i]);
+			fifo_mode[i] = GLOBALFIFO_MUTEX;
+		}
+		if (fifo_order[i] != GLOBALFIFO_ORDER_CPU && fifo_order[i] != GLOBALFIFO_ORDER_TS) {
+			printk(KERN_INFO "Bad fifo order %d, using per-cpu order\n", fifo_order[i]);
+			fifo_order[i] = GLOBALFIFO_ORDER_CPU;
+		}
+		(global_mem_devp_tmp + i)->mode = fifo_mode[i];
+		(global_mem_devp_tmp + i)->order = fifo_order[i];
+		(global_mem_devp_tmp + i)->drop = !!fifo_drop[i];
+		INIT_LIST_HEAD(&(global_mem_devp_tmp + i)->readers);
+		(global_mem_devp_tmp + i)->size = GLOBALMEM_SIZE;
+		/* vmalloc_user申请的内存是清零的，可以用remap_vmalloc_range映射到用户空间 */
+		(global_mem_devp_tmp + i)->ring = vmalloc_user(PAGE_SIZE + GLOBALMEM_SIZE);
+		if (!(global_mem_devp_tmp + i)->ring) {
+			ret = -ENOMEM;
+			goto fail_mem;
+		}
+		(global_mem_devp_tmp + i)->mem = (unsigned char *)(global_mem_devp_tmp + i)->ring + PAGE_SIZE;
+		(global_mem_devp_tmp + i)->ring->size = GLOBALMEM_SIZE;
+		(global_mem_devp_tmp + i)->ring->data_offset = PAGE_SIZE;
+		/* 默认水位为1，和原来有1个字节就唤醒的行为一致 */
+		(global_mem_devp_tmp + i)->read_wm = 1;
+		(global_mem_devp_tmp + i)->write_wm = 1;
+		(global_mem_devp_tmp + i)->ring->read_wm = 1;
+		(global_mem_devp_tmp + i)->ring->write_wm = 1;
+
+		/* PERCPU模式另外为每个CPU分配一个同样大小的子环 */
+		if (fifo_mode[i] == GLOBALFIFO_PERCPU) {
+			ret = global_mem_pcpu_alloc(global_mem_devp_tmp + i);
+			if (ret) {
+				global_mem_pcpu_free(global_mem_devp_tmp + i);
+				vfree((global_mem_devp_tmp + i)->ring);
+				goto fail_mem;
+			}
+		}
+
+		/* 记录模式的kfifo大小和环形缓冲区一样，是2的幂 */
+		if (fifo_mode[i] == GLOBALFIFO_RECORD) {
+			ret = kfifo_alloc(&(global_mem_devp_tmp + i)->rec, GLOBALMEM_SIZE, GFP_KERNEL);
+			if (ret) {
+				vfree((global_mem_devp_tmp + i)->ring);
+				goto fail_mem;
+			}
+		}
+
+		/* 页模式的槽，数据在write或者splice_write时才有页 */
+		if (fifo_mode[i] == GLOBALFIFO_PAGE) {
+			(global_mem_devp_tmp + i)->pages = kcalloc(GLOBALFIFO_PAGE_SLOTS,
+								   sizeof(struct globalfifo_page), GFP_KERNEL);
+			if (!(global_mem_devp_tmp + i)->pages) {
+				vfree((global_mem_devp_tmp + i)->ring);
+				ret = -ENOMEM;
+				goto fail_mem;
+			}
+		}
+	}
+
 	for (i = 0; i < DEVICE_NUM; i++) {
 		mutex_init(&(global_mem_devp_tmp + i)->mutex);
 		init_waitqueue_head(&(global_mem_devp_tmp + i)->r_wait);
 		init_waitqueue_head(&(global_mem_devp_tmp + i)->w_wait);
-		cdev_init(&(global_mem_devp_tmp + i)->cdev, &global_mem_fops);
+		cdev_init(&(global_mem_devp_tmp + i)->cdev, global_mem_mode_fops[fifo_mode[i]]);
 		(global_mem_devp_tmp + i)->cdev.owner = THIS_MODULE;
 		ret = cdev_add(&(global_mem_devp_tmp + i)->cdev, MKDEV(MAJOR(devno), i), 1);
 		if (ret)
@@ -335,6 +2453,15 @@ static int __init global_mem_probe(struct platform_device *pdev)
 
 	return 0;
 
+fail_mem:
+	while (i--) {
+		kvfree((global_mem_devp_tmp + i)->mem_alloc);
+		kfifo_free(&(global_mem_devp_tmp + i)->rec);
+		global_mem_page_free(global_mem_devp_tmp + i);
+		global_mem_pcpu_free(global_mem_devp_tmp + i);
+		vfree((global_mem_devp_tmp + i)->ring);
+	}
+	kfree(global_mem_devp);
 fail_malloc:
 	unregister_chrdev_region(devno, DEVICE_NUM);
 	return ret;
@@ -344,8 +2471,14 @@ static int __exit global_mem_remove(struct platform_device *pdev)
 {
 	int i = 0;
 	
-	for (i = 0; i < DEVICE_NUM; i++)
+	for (i = 0; i < DEVICE_NUM; i++) {
 		cdev_del(&(global_mem_devp + i)->cdev);
+		global_mem_pcpu_free(global_mem_devp + i);
+		kfifo_free(&(global_mem_devp + i)->rec);
+		global_mem_page_free(global_mem_devp + i);
+		kvfree((global_mem_devp + i)->mem_alloc);
+		vfree((global_mem_devp + i)->ring);
+	}
 
 	kfree(global_mem_devp);
 	unregister_chrdev_region(devno, DEVICE_NUM);
@@ -0,0 +1,107 @@
+/*
+ * globalfifo 内核和用户空间共用的定义：ioctl命令和共享内存环的布局
+ */
+#ifndef _GLOBALFIFO_H
+#define _GLOBALFIFO_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define GLOBAL_MEM_MAGIC 'g'
+#define MEM_CLEAR _IO(GLOBAL_MEM_MAGIC, 0)
+#define FIFO_DOORBELL _IO(GLOBAL_MEM_MAGIC, 1)	/* 用户空间移动了指针，唤醒睡眠的对端 */
+
+/*
+ * 读写水位，取值1到fifo大小，默认都是1
+ * 阻塞的读进程等到数据达到read_wm字节才被唤醒，poll也是这时才返回POLLIN，SIGIO在越过read_wm时发送
+ * 阻塞的写进程等到空间达到write_wm字节才被唤醒，poll也是这时才返回POLLOUT
+ * 非阻塞读写和socket的SO_RCVLOWAT一样，有数据(空间)就立即返回
+ */
+struct globalfifo_watermark {
+	__u32 read_wm;
+	__u32 write_wm;
+};
+
+#define FIFO_SET_WATERMARK _IOW(GLOBAL_MEM_MAGIC, 2, struct globalfifo_watermark)
+#define FIFO_GET_WATERMARK _IOR(GLOBAL_MEM_MAGIC, 3, struct globalfifo_watermark)
+
+/*
+ * 记录模式(fifo_mode=3)下一次读出多条消息，至少读到一条消息才返回(非阻塞方式返回EAGAIN)
+ * buf中每条消息是一个__u32的长度后面跟着数据，下一条消息从GLOBALFIFO_REC_ALIGN对齐的位置开始
+ * 返回值和count都是读到的消息数，bytes是buf中用到的字节数
+ */
+struct globalfifo_batch {
+	__u64 buf;		/* 用户空间的缓冲区 */
+	__u32 len;		/* 缓冲区的长度 */
+	__u32 count;		/* 输出：读到的消息数 */
+	__u32 bytes;		/* 输出：用到的字节数 */
+	__u32 pad;
+};
+
+#define GLOBALFIFO_REC_ALIGN 4
+/* 记录模式中一条消息的最大长度：4096字节的fifo减去kfifo的2字节记录头 */
+#define GLOBALFIFO_REC_MAX 4094
+#define FIFO_READ_BATCH _IOWR(GLOBAL_MEM_MAGIC, 4, struct globalfifo_batch)
+
+/*
+ * 在线修改fifo的大小，fifo中的数据保留，新的大小必须是2的幂，并且放得下fifo中现有的数据
+ * 只支持持有mutex读写的mutex模式和广播模式
+ */
+#define FIFO_SET_SIZE _IOW(GLOBAL_MEM_MAGIC, 5, __u32)
+
+/* fifo的使用情况，用max_len和full判断fifo的大小是否合适 */
+struct globalfifo_stats {
+	__u32 size;		/* 当前的大小 */
+	__u32 len;		/* 当前的数据长度 */
+	__u32 max_len;		/* 数据长度的最大值(高水位)，FIFO_RESET_STATS清零 */
+	__u32 pad;
+	__u64 full;		/* 写进程因为fifo满而等待(或者返回EAGAIN)的次数 */
+};
+
+#define FIFO_GET_STATS _IOR(GLOBAL_MEM_MAGIC, 6, struct globalfifo_stats)
+#define FIFO_RESET_STATS _IO(GLOBAL_MEM_MAGIC, 7)
+
+/*
+ * 为设备的一个方向注册eventfd，fd为-1表示取消注册；每个方向只能由一个文件注册，文件关闭时自动取消
+ * 和poll的POLLIN/POLLOUT一致，只在从不可读(不可写)变为可读(可写)时给eventfd加1，
+ * 所以用户读eventfd之后要一直读(写)设备到EAGAIN，和EPOLLET一样
+ * 注册时已经可读(可写)的话立即通知一次
+ */
+#define GLOBALFIFO_EVENT_READ	0	/* 可读 */
+#define GLOBALFIFO_EVENT_WRITE	1	/* 可写 */
+
+struct globalfifo_eventfd {
+	__s32 fd;
+	__u32 dir;		/* GLOBALFIFO_EVENT_READ 或 GLOBALFIFO_EVENT_WRITE */
+};
+
+#define FIFO_SET_EVENTFD _IOW(GLOBAL_MEM_MAGIC, 8, struct globalfifo_eventfd)
+
+#define GLOBALFIFO_CACHELINE 64
+
+/*
+ * SPSC模式下mmap得到的控制页，数据区紧跟在控制页后面(偏移data_offset)
+ * in和out放在不同的cache line，生产者和消费者不会互相抢同一个cache line
+ *
+ * 生产者: 写数据 -> store-release in -> 全屏障 -> read_wakeup非0时ioctl(FIFO_DOORBELL)
+ * 消费者: 读数据 -> store-release out -> 全屏障 -> write_wakeup非0时ioctl(FIFO_DOORBELL)
+ * 内核中的读者(写者)睡眠之前把read_wakeup(write_wakeup)置1，对端没有睡眠时不需要系统调用
+ * 设置了水位时，数据(空间)达到对端的水位之前也不需要敲门铃
+ * 注册了eventfd的方向唤醒标志一直是1，每次移动指针都要敲门铃
+ */
+struct globalfifo_ring {
+	__u32 in;		/* 写指针，只增不减，由生产者更新 */
+	__u32 read_wakeup;	/* 非0表示可能有读者在睡眠，由内核置1，敲门铃后清0 */
+	__u8 pad0[GLOBALFIFO_CACHELINE - 2 * sizeof(__u32)];
+
+	__u32 out;		/* 读指针，只增不减，由消费者更新 */
+	__u32 write_wakeup;	/* 非0表示可能有写者在睡眠 */
+	__u8 pad1[GLOBALFIFO_CACHELINE - 2 * sizeof(__u32)];
+
+	__u32 size;		/* 数据区大小，是2的幂，只读 */
+	__u32 data_offset;	/* 数据区在映射中的偏移，只读 */
+	__u32 read_wm;		/* 当前的读水位，只读，由FIFO_SET_WATERMARK设置 */
+	__u32 write_wm;		/* 当前的写水位，只读 */
+};
+
+#endif /* _GLOBALFIFO_H */
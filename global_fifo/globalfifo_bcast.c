@@ -0,0 +1,123 @@
+/*
+ * globalfifo 广播模式测试
+ * 模块以 fifo_mode=4 加载(加上 fifo_drop=1 测试丢弃最慢的读者)：
+ *	./globalfifo_bcast [-r 读进程数] [-n 字节数] [-s 慢读者每次读之后睡眠的us]
+ *
+ * 写进程只写一份数据，每个读进程都应该读到全部数据；
+ * -s 让最后一个读进程变慢，丢弃策略下它会收到EPIPE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+static const char *dev_name = "/dev/global_mem_0";
+
+/*
+ * 读进程：数据是0,1,2...255循环的字节，检查顺序并统计读到的字节数
+ * 被丢弃过的读者读不满total，1秒没有新数据就退出
+ */
+static int reader(int fd, long total, int slow)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	unsigned char buf[512];
+	unsigned char expect = 0;
+	long got = 0, drops = 0;
+	ssize_t ret, i;
+
+	while (got < total) {
+		if (poll(&pfd, 1, 1000) <= 0)
+			break;
+
+		ret = read(fd, buf, sizeof(buf));
+		if (ret < 0 && errno == EPIPE) {
+			/* 中间的数据丢了，从新的位置重新同步 */
+			drops++;
+			ret = read(fd, buf, sizeof(buf));
+			if (ret > 0)
+				expect = buf[0];
+		}
+		if (ret <= 0)
+			break;
+
+		for (i = 0; i < ret; i++, expect++)
+			if (buf[i] != expect) {
+				printf("reader %d: bad byte at %ld\n", getpid(), got + i);
+				return 1;
+			}
+		got += ret;
+
+		if (slow)
+			usleep(slow);
+	}
+
+	printf("reader %d: read %ld byte(s), dropped %ld time(s)\n", getpid(), got, drops);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char buf[512];
+	int readers = 4, slow = 0, opt, i, fd;
+	long total = 1 << 20, done;
+	ssize_t ret;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "r:n:s:")) != -1) {
+		switch (opt) {
+		case 'r':
+			readers = atoi(optarg);
+			break;
+		case 'n':
+			total = atol(optarg);
+			break;
+		case 's':
+			slow = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-r readers] [-n bytes] [-s slow us]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* 读进程在fork之前打开设备，保证写入的数据都能读到 */
+	for (i = 0; i < readers; i++) {
+		fd = open(dev_name, O_RDONLY);
+		if (fd == -1) {
+			printf("fail to open %s\n", dev_name);
+			return 1;
+		}
+
+		pid = fork();
+		if (pid == 0)
+			return reader(fd, total, i == readers - 1 ? slow : 0);
+		close(fd);
+	}
+
+	fd = open(dev_name, O_WRONLY);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return 1;
+	}
+
+	for (i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = i;
+
+	/* buf中是两个周期的数据，短写之后从(done & 255)开始写，字节仍然是连续的 */
+	for (done = 0; done < total; done += ret) {
+		ret = write(fd, buf + (done & 255), total - done < 256 ? total - done : 256);
+		if (ret <= 0) {
+			printf("write() fail\n");
+			break;
+		}
+	}
+	close(fd);
+
+	while (wait(NULL) > 0)
+		;
+
+	return 0;
+}
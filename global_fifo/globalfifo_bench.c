@@ -0,0 +1,115 @@
+/*
+ * globalfifo 排空吞吐量测试
+ *
+ * 每一轮先把fifo写满，再用固定大小的read把fifo读空，只统计读空的时间：
+ *	./globalfifo_bench [-d /dev/global_mem_0] [-r 轮数]
+ *
+ * 分别加载旧的(memcpy搬移)和新的(环形缓冲区)模块运行，对比不同读块大小下的结果
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+static const char *dev_name = "/dev/global_mem_0";
+static int rounds = 1000;
+static const size_t chunks[] = { 1, 4, 16, 64, 256, 1024, 4096 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 非阻塞写，直到fifo满，返回写入的字节数 */
+static size_t fill(int fd, char *buf, size_t len)
+{
+	size_t total = 0;
+	ssize_t ret;
+
+	while ((ret = write(fd, buf, len)) > 0)
+		total += ret;
+
+	return total;
+}
+
+/* 非阻塞读，直到fifo空，返回读的次数 */
+static long drain(int fd, char *buf, size_t chunk, size_t *bytes)
+{
+	long reads = 0;
+	ssize_t ret;
+
+	while ((ret = read(fd, buf, chunk)) > 0) {
+		*bytes += ret;
+		reads++;
+	}
+
+	if (ret < 0 && errno != EAGAIN)
+		perror("read");
+
+	return reads;
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[4096];
+	size_t i, bytes, filled;
+	long reads;
+	double elapsed, begin;
+	int fd, opt, r;
+
+	while ((opt = getopt(argc, argv, "d:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-d dev] [-r rounds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	fd = open(dev_name, O_RDWR | O_NONBLOCK);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return 1;
+	}
+
+	/* 先把fifo中残留的数据读掉 */
+	memset(buf, 0x5a, sizeof(buf));
+	bytes = 0;
+	drain(fd, buf, sizeof(buf), &bytes);
+
+	printf("%8s %12s %14s\n", "chunk", "MB/s", "reads/s");
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+		elapsed = 0;
+		bytes = 0;
+		reads = 0;
+
+		for (r = 0; r < rounds; r++) {
+			filled = fill(fd, buf, sizeof(buf));
+			if (!filled) {
+				printf("fail to fill fifo\n");
+				return 1;
+			}
+
+			begin = now();
+			reads += drain(fd, buf, chunks[i], &bytes);
+			elapsed += now() - begin;
+		}
+
+		printf("%8zu %12.1f %14.0f\n", chunks[i],
+		       bytes / elapsed / (1024 * 1024), reads / elapsed);
+	}
+
+	close(fd);
+	return 0;
+}
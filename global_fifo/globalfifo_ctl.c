@@ -0,0 +1,67 @@
+/*
+ * globalfifo 大小和统计信息
+ *	./globalfifo_ctl [-d /dev/global_mem_0]		查看大小、数据长度、高水位和fifo满的次数
+ *	./globalfifo_ctl -s 65536			在线修改fifo的大小，数据保留
+ *	./globalfifo_ctl -r				统计清零
+ *
+ * 根据一段时间内的max_len和full决定fifo的大小：full一直增加说明fifo太小
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "globalfifo.h"
+
+int main(int argc, char *argv[])
+{
+	const char *dev_name = "/dev/global_mem_0";
+	struct globalfifo_stats stats;
+	__u32 size = 0;
+	int reset = 0, opt, fd;
+
+	while ((opt = getopt(argc, argv, "d:s:r")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			reset = 1;
+			break;
+		default:
+			printf("usage: %s [-d dev] [-s size] [-r]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* 只写方式打开，广播模式下不会多出一个读者 */
+	fd = open(dev_name, O_WRONLY | O_NONBLOCK);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return 1;
+	}
+
+	if (size && ioctl(fd, FIFO_SET_SIZE, &size) < 0) {
+		perror("ioctl FIFO_SET_SIZE");
+		return 1;
+	}
+
+	if (ioctl(fd, FIFO_GET_STATS, &stats) < 0) {
+		perror("ioctl FIFO_GET_STATS");
+		return 1;
+	}
+	printf("size %u, len %u, max_len %u, full %llu\n", stats.size, stats.len,
+	       stats.max_len, (unsigned long long)stats.full);
+
+	if (reset && ioctl(fd, FIFO_RESET_STATS) < 0) {
+		perror("ioctl FIFO_RESET_STATS");
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
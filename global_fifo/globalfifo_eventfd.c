@@ -0,0 +1,92 @@
+/*
+ * globalfifo eventfd通知测试
+ *	./globalfifo_eventfd [-d /dev/global_mem_0]
+ *
+ * 给设备注册一个可读的eventfd，epoll等待的是eventfd而不是设备本身，
+ * 每次通知之后把设备读到EAGAIN为止，另一个终端 echo hello > /dev/global_mem_0 写入
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "globalfifo.h"
+
+int main(int argc, char *argv[])
+{
+	const char *dev_name = "/dev/global_mem_0";
+	struct globalfifo_eventfd reg;
+	struct epoll_event ev;
+	char buf[256];
+	uint64_t events;
+	ssize_t ret;
+	long total;
+	int fd, efd, epfd, opt;
+
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		default:
+			printf("usage: %s [-d dev]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	fd = open(dev_name, O_RDONLY | O_NONBLOCK);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return 1;
+	}
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd == -1) {
+		perror("eventfd");
+		return 1;
+	}
+
+	reg.fd = efd;
+	reg.dir = GLOBALFIFO_EVENT_READ;
+	if (ioctl(fd, FIFO_SET_EVENTFD, &reg) < 0) {
+		perror("ioctl FIFO_SET_EVENTFD");
+		return 1;
+	}
+
+	epfd = epoll_create1(0);
+	ev.events = EPOLLIN;
+	ev.data.fd = efd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev) < 0) {
+		perror("epoll_ctl");
+		return 1;
+	}
+
+	for (;;) {
+		if (epoll_wait(epfd, &ev, 1, -1) <= 0)
+			continue;
+
+		/* eventfd的计数是合并之后的通知次数，读出来清零 */
+		if (read(efd, &events, sizeof(events)) != sizeof(events))
+			continue;
+
+		/* 只有从不可读变为可读才会再次通知，所以要读到EAGAIN为止 */
+		total = 0;
+		while ((ret = read(fd, buf, sizeof(buf))) > 0)
+			total += ret;
+		if (ret < 0 && errno != EAGAIN) {
+			perror("read");
+			break;
+		}
+
+		printf("%llu event(s), read %ld byte(s)\n", (unsigned long long)events, total);
+	}
+
+	close(epfd);
+	close(efd);
+	close(fd);
+	return 0;
+}
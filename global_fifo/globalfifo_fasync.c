@@ -20,7 +20,8 @@ void main(void)
 		fcntl(fd, F_SETOWN, getpid());
 		oflags = fcntl(fd, F_GETFL);
 		fcntl(fd, F_SETFL, oflags | FASYNC);
-		while (1);
+		while (1)
+			pause();
 	} else {
 		printf("device open failure\n");
 	}
@@ -0,0 +1,238 @@
+/*
+ * globalfifo 多读者惊群测试
+ *
+ * 多个读线程等待同一个fifo，一个写线程每隔一段时间写一条消息，统计每条消息浪费的唤醒次数：
+ *	./globalfifo_herd [-d /dev/global_mem_0] [-t 读线程数] [-n 消息数] [-i 间隔us]
+ *			  [-m block|epoll|epollex] [-e]
+ *
+ * block    读线程阻塞在read中
+ * epoll    读线程各自epoll_wait，非阻塞read
+ * epollex  同上，加上EPOLLEXCLUSIVE
+ * -e       epoll使用EPOLLET
+ *
+ * 唤醒次数用读线程的主动上下文切换次数(/proc/self/task/<tid>/status)统计，
+ * 减去读到数据的次数就是浪费的唤醒
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+#define MSG_LEN 16
+
+enum {
+	HERD_BLOCK,
+	HERD_EPOLL,
+	HERD_EPOLLEX,
+};
+
+static const char *dev_name = "/dev/global_mem_0";
+static int readers = 8;
+static long messages = 10000;
+static int interval = 100;
+static int mode = HERD_BLOCK;
+static int edge;
+
+struct herd_thread {
+	pthread_t tid;
+	volatile pid_t task;	/* 线程的tid，用来读/proc/self/task/<tid>/status */
+	volatile long msgs;	/* 读到的消息数 */
+	volatile long hits;	/* 被唤醒之后读到数据的次数，EPOLLET下一次可能读到多条消息 */
+	volatile long empty;	/* 被唤醒之后没有读到数据(EAGAIN)的次数 */
+};
+
+/* 线程的主动上下文切换次数，每次睡眠再被唤醒算一次 */
+static long nvcsw(pid_t task)
+{
+	char path[64], line[128];
+	long n = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/status", task);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1)
+			break;
+
+	fclose(fp);
+	return n;
+}
+
+/* 非阻塞地读出所有完整的消息，EPOLLET下必须读到EAGAIN为止 */
+static void drain(int fd, struct herd_thread *t)
+{
+	char buf[MSG_LEN];
+	ssize_t ret;
+	int got = 0;
+
+	for (;;) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret <= 0)
+			break;
+		t->msgs += ret / MSG_LEN;
+		got = 1;
+		if (!edge)
+			break;
+	}
+
+	if (got)
+		t->hits++;
+	else
+		t->empty++;
+}
+
+static void *reader(void *arg)
+{
+	struct herd_thread *t = arg;
+	struct epoll_event ev;
+	char buf[MSG_LEN];
+	ssize_t ret;
+	int fd, epfd = -1;
+
+	t->task = syscall(SYS_gettid);
+
+	fd = open(dev_name, O_RDONLY | (mode == HERD_BLOCK ? 0 : O_NONBLOCK));
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return NULL;
+	}
+
+	if (mode != HERD_BLOCK) {
+		epfd = epoll_create1(0);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		if (mode == HERD_EPOLLEX)
+			ev.events |= EPOLLEXCLUSIVE;
+		if (edge)
+			ev.events |= EPOLLET;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			printf("epoll_ctl() fail: %s\n", strerror(errno));
+			close(fd);
+			return NULL;
+		}
+	}
+
+	/* 一直运行到主线程pthread_cancel，read和epoll_wait都是取消点 */
+	for (;;) {
+		if (mode == HERD_BLOCK) {
+			ret = read(fd, buf, sizeof(buf));
+			if (ret > 0) {
+				t->msgs += ret / MSG_LEN;
+				t->hits++;
+			}
+		} else if (epoll_wait(epfd, &ev, 1, -1) > 0) {
+			drain(fd, t);
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct herd_thread *threads;
+	char msg[MSG_LEN];
+	long msgs = 0, hits = 0, empty = 0, switches = 0, n, *begin;
+	int fd, opt, i;
+
+	while ((opt = getopt(argc, argv, "d:t:n:i:m:e")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 't':
+			readers = atoi(optarg);
+			break;
+		case 'n':
+			messages = atol(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "epoll"))
+				mode = HERD_EPOLL;
+			else if (!strcmp(optarg, "epollex"))
+				mode = HERD_EPOLLEX;
+			else
+				mode = HERD_BLOCK;
+			break;
+		case 'e':
+			edge = 1;
+			break;
+		default:
+			printf("usage: %s [-d dev] [-t readers] [-n messages] [-i interval us] "
+			       "[-m block|epoll|epollex] [-e]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (readers <= 0 || messages <= 0) {
+		printf("invalid arguments\n");
+		return 1;
+	}
+
+	fd = open(dev_name, O_WRONLY);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return 1;
+	}
+
+	threads = calloc(readers, sizeof(*threads));
+	begin = calloc(readers, sizeof(*begin));
+	if (!threads || !begin)
+		return 1;
+
+	for (i = 0; i < readers; i++)
+		pthread_create(&threads[i].tid, NULL, reader, &threads[i]);
+
+	/* 等读线程都睡下之后再开始写 */
+	sleep(1);
+	for (i = 0; i < readers; i++)
+		begin[i] = nvcsw(threads[i].task);
+
+	memset(msg, 'h', sizeof(msg));
+	for (n = 0; n < messages; n++) {
+		if (write(fd, msg, sizeof(msg)) != sizeof(msg)) {
+			printf("write() fail\n");
+			break;
+		}
+		usleep(interval);
+	}
+
+	/* 等消息被读完，读线程都睡下之后再统计 */
+	sleep(1);
+	for (i = 0; i < readers; i++) {
+		switches += nvcsw(threads[i].task) - begin[i];
+		msgs += threads[i].msgs;
+		hits += threads[i].hits;
+		empty += threads[i].empty;
+	}
+
+	for (i = 0; i < readers; i++) {
+		pthread_cancel(threads[i].tid);
+		pthread_join(threads[i].tid, NULL);
+	}
+
+	printf("readers %d, messages %ld, read %ld\n", readers, messages, msgs);
+	printf("wakeups %ld, empty reads %ld, wasted wakeups per message %.2f\n",
+	       switches, empty, (double)(switches - hits) / messages);
+
+	free(begin);
+	free(threads);
+	close(fd);
+	return 0;
+}
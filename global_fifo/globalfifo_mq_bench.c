@@ -0,0 +1,171 @@
+/*
+ * globalfifo 多生产者测试
+ *
+ * 每个生产者线程绑定到一个CPU上不停地写固定大小的消息，一个消费者线程不停地读：
+ *	./globalfifo_mq_bench [-d /dev/global_mem_0] [-t 生产者数] [-b 消息大小] [-s 秒数]
+ *
+ * 分别用 fifo_mode=0(mutex) 和 fifo_mode=2(PERCPU) 加载模块，对比生产者增加时的吞吐量
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+static const char *dev_name = "/dev/global_mem_0";
+static int producers = 4;
+static size_t msg_size = 64;
+static int seconds = 3;
+
+static volatile int stop;
+
+struct bench_thread {
+	pthread_t tid;
+	int cpu;
+	unsigned long ops;
+	unsigned long bytes;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer(void *arg)
+{
+	struct bench_thread *t = arg;
+	char buf[4096];
+	cpu_set_t set;
+	ssize_t ret;
+	int fd;
+
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	/* 非阻塞写，fifo满时让出CPU，测试结束时不会阻塞在write中 */
+	fd = open(dev_name, O_WRONLY | O_NONBLOCK);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return NULL;
+	}
+	memset(buf, 'a' + t->cpu % 26, msg_size);
+
+	while (!stop) {
+		ret = write(fd, buf, msg_size);
+		if (ret > 0) {
+			t->ops++;
+			t->bytes += ret;
+		} else {
+			sched_yield();
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct bench_thread *t = arg;
+	char buf[4096];
+	ssize_t ret;
+	int fd;
+
+	fd = open(dev_name, O_RDONLY | O_NONBLOCK);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return NULL;
+	}
+
+	while (!stop) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret > 0)
+			t->bytes += ret;
+		else
+			sched_yield();
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void run(int n)
+{
+	struct bench_thread *threads = calloc(n, sizeof(*threads));
+	struct bench_thread reader = { 0 };
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long ops = 0;
+	double begin, elapsed;
+	int i;
+
+	if (!threads)
+		return;
+
+	stop = 0;
+	begin = now();
+	pthread_create(&reader.tid, NULL, consumer, &reader);
+	for (i = 0; i < n; i++) {
+		threads[i].cpu = i % ncpu;
+		pthread_create(&threads[i].tid, NULL, producer, &threads[i]);
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ops += threads[i].ops;
+	}
+	pthread_join(reader.tid, NULL);
+	elapsed = now() - begin;
+
+	printf("%10d %14.0f %14.1f\n", n, ops / elapsed,
+	       reader.bytes / elapsed / (1024 * 1024));
+	free(threads);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "d:t:b:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 't':
+			producers = atoi(optarg);
+			break;
+		case 'b':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-d dev] [-t producers] [-b msg size] [-s sec]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (producers <= 0 || !msg_size || msg_size > 4096 || seconds <= 0) {
+		printf("invalid arguments\n");
+		return 1;
+	}
+
+	printf("device %s, message %zu byte(s)\n", dev_name, msg_size);
+	printf("%10s %14s %14s\n", "producers", "writes/s", "read MB/s");
+
+	for (n = 1; n <= producers; n *= 2)
+		run(n);
+
+	return 0;
+}
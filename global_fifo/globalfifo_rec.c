@@ -0,0 +1,146 @@
+/*
+ * globalfifo 记录模式测试
+ * 模块以 fifo_mode=3 加载，global_mem_0 工作在记录模式：
+ *	./globalfifo_rec -p 100000	生产者，每次write一条长度不同的消息
+ *	./globalfifo_rec -c		消费者，用FIFO_READ_BATCH一次读出多条消息并检查边界
+ *	./globalfifo_rec -m		在空的fifo中写入一条GLOBALFIFO_REC_MAX字节的消息，检查能写入并原样读出
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "globalfifo.h"
+
+static void produce(int fd, long count)
+{
+	char msg[256];
+	int len;
+	long n;
+
+	for (n = 0; n < count; n++) {
+		/* 消息的长度从十几个字节到两百多字节不等 */
+		len = snprintf(msg, sizeof(msg), "msg %ld ", n);
+		memset(msg + len, 'a' + n % 26, n % 200);
+		len += n % 200;
+
+		if (write(fd, msg, len) != len) {
+			printf("write() fail at message %ld\n", n);
+			return;
+		}
+	}
+
+	printf("produced %ld message(s)\n", count);
+}
+
+static void consume(int fd)
+{
+	struct globalfifo_batch batch;
+	char buf[16384];
+	unsigned long n = 0, calls = 0;
+	unsigned int off, i;
+	uint32_t len;
+	long next;
+	int ret;
+
+	for (;;) {
+		batch.buf = (uintptr_t)buf;
+		batch.len = sizeof(buf);
+		ret = ioctl(fd, FIFO_READ_BATCH, &batch);
+		if (ret < 0) {
+			printf("ioctl FIFO_READ_BATCH fail\n");
+			return;
+		}
+		calls++;
+
+		for (i = 0, off = 0; i < batch.count; i++) {
+			memcpy(&len, buf + off, sizeof(len));
+
+			/* 每条消息都以"msg 序号 "开头，长度和序号对得上说明边界正确 */
+			next = atol(buf + off + sizeof(len) + 4);
+			if (len != strlen("msg ") + snprintf(NULL, 0, "%ld ", next) + next % 200)
+				printf("bad message %ld, len %u\n", next, len);
+
+			off += (sizeof(len) + len + GLOBALFIFO_REC_ALIGN - 1) & ~(GLOBALFIFO_REC_ALIGN - 1);
+			n++;
+		}
+
+		if (n / 100000 != (n - batch.count) / 100000)
+			printf("consumed %lu message(s) in %lu call(s)\n", n, calls);
+	}
+}
+
+/* 最大的消息：空fifo一定能放下，多一个字节返回EMSGSIZE */
+static int max_record(int fd)
+{
+	char msg[GLOBALFIFO_REC_MAX + 1], buf[GLOBALFIFO_REC_MAX];
+	ssize_t ret;
+	int i;
+
+	/* 先读空fifo */
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	for (i = 0; i < (int)sizeof(msg); i++)
+		msg[i] = 'a' + i % 26;
+
+	ret = write(fd, msg, GLOBALFIFO_REC_MAX);
+	if (ret != GLOBALFIFO_REC_MAX) {
+		printf("write %d byte(s) fail: %s\n", GLOBALFIFO_REC_MAX, strerror(errno));
+		return 1;
+	}
+
+	ret = read(fd, buf, sizeof(buf));
+	if (ret != GLOBALFIFO_REC_MAX || memcmp(buf, msg, GLOBALFIFO_REC_MAX)) {
+		printf("read back %zd byte(s), bad message\n", ret);
+		return 1;
+	}
+
+	if (write(fd, msg, GLOBALFIFO_REC_MAX + 1) >= 0 || errno != EMSGSIZE) {
+		printf("write %d byte(s) should fail with EMSGSIZE\n", GLOBALFIFO_REC_MAX + 1);
+		return 1;
+	}
+
+	printf("max record %d byte(s) ok\n", GLOBALFIFO_REC_MAX);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, ret;
+
+	if (argc < 2 || (strcmp(argv[1], "-p") && strcmp(argv[1], "-c") && strcmp(argv[1], "-m"))) {
+		printf("usage: %s -p count | -c | -m\n", argv[0]);
+		return 1;
+	}
+
+	if (argv[1][1] == 'm') {
+		/* 非阻塞方式打开，写不进去时返回EAGAIN而不是一直睡眠 */
+		fd = open("/dev/global_mem_0", O_RDWR | O_NONBLOCK);
+		if (fd == -1) {
+			printf("fail to open device.\n");
+			return 1;
+		}
+		ret = max_record(fd);
+		close(fd);
+		return ret;
+	}
+
+	fd = open("/dev/global_mem_0", O_RDWR);
+	if (fd == -1) {
+		printf("fail to open device.\n");
+		return 1;
+	}
+
+	if (argv[1][1] == 'p')
+		produce(fd, argc > 2 ? atol(argv[2]) : 1000000);
+	else
+		consume(fd);
+
+	close(fd);
+	return 0;
+}
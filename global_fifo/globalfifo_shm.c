@@ -0,0 +1,156 @@
+/*
+ * globalfifo 共享内存环的用户空间生产者/消费者
+ * 模块以 fifo_mode=1 加载，global_mem_0 工作在SPSC模式：
+ *	./globalfifo_shm -c		消费者，数据为空时poll睡眠
+ *	./globalfifo_shm -c 1024	消费者，读水位设为1024，攒够1024字节才被唤醒
+ *	./globalfifo_shm -p 100000	生产者，写入100000条消息
+ * 对端没有睡眠时，收发消息不需要任何系统调用
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "globalfifo.h"
+
+#define MSG_LEN 16
+
+static struct globalfifo_ring *ring;
+static unsigned char *data;
+
+static unsigned int load_acquire(__u32 *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(__u32 *p, unsigned int v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/*
+ * 移动指针之后，如果对端可能在睡眠，并且数据(空间)已经达到对端的水位，敲门铃唤醒它
+ * ready是对端现在可以得到的数据(空间)字节数，wm是对端的水位
+ */
+static void kick(int fd, __u32 *wakeup, unsigned int ready, __u32 *wm)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(wakeup, __ATOMIC_RELAXED) &&
+	    ready >= __atomic_load_n(wm, __ATOMIC_RELAXED))
+		ioctl(fd, FIFO_DOORBELL);
+}
+
+static void produce(int fd, long count)
+{
+	unsigned int size = ring->size;
+	unsigned int in = ring->in;
+	unsigned char msg[MSG_LEN];
+	unsigned int i;
+	long n;
+
+	for (n = 0; n < count; n++) {
+		/* "msg "加上最多11位的序号正好放进MSG_LEN，序号超过之后回绕 */
+		snprintf((char *)msg, sizeof(msg), "msg %lu", (unsigned long)n % 100000000000UL);
+
+		/* fifo满时poll等待消费者腾出空间 */
+		while (size - (in - load_acquire(&ring->out)) < MSG_LEN) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+			poll(&pfd, 1, -1);
+		}
+
+		for (i = 0; i < MSG_LEN; i++)
+			data[(in + i) & (size - 1)] = msg[i];
+
+		in += MSG_LEN;
+		store_release(&ring->in, in);
+		kick(fd, &ring->read_wakeup, in - load_acquire(&ring->out), &ring->read_wm);
+	}
+
+	printf("produced %ld message(s)\n", count);
+}
+
+static void consume(int fd)
+{
+	unsigned int size = ring->size;
+	unsigned int out = ring->out;
+	unsigned char msg[MSG_LEN];
+	unsigned long n = 0;
+	unsigned int i;
+
+	for (;;) {
+		/* fifo空时poll等待生产者，内核会把read_wakeup置1 */
+		while (load_acquire(&ring->in) - out < MSG_LEN) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+			poll(&pfd, 1, -1);
+		}
+
+		for (i = 0; i < MSG_LEN; i++)
+			msg[i] = data[(out + i) & (size - 1)];
+
+		out += MSG_LEN;
+		store_release(&ring->out, out);
+		kick(fd, &ring->write_wakeup, size - (load_acquire(&ring->in) - out), &ring->write_wm);
+
+		if (++n % 100000 == 0)
+			printf("consumed %lu message(s), last: %.*s\n", n, MSG_LEN, msg);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct globalfifo_ring *ctl;
+	size_t len;
+	int fd;
+
+	if (argc < 2 || (strcmp(argv[1], "-p") && strcmp(argv[1], "-c"))) {
+		printf("usage: %s -p count | -c [read_wm]\n", argv[0]);
+		return 1;
+	}
+
+	fd = open("/dev/global_mem_0", O_RDWR);
+	if (fd == -1) {
+		printf("fail to open device.\n");
+		return 1;
+	}
+
+	/* 先映射控制页，得到数据区的偏移和大小，再映射整个环 */
+	ctl = mmap(NULL, sizeof(*ctl), PROT_READ, MAP_SHARED, fd, 0);
+	if (ctl == MAP_FAILED) {
+		printf("mmap() fail, is the device in SPSC mode?\n");
+		return 1;
+	}
+	len = ctl->data_offset + ctl->size;
+	munmap(ctl, sizeof(*ctl));
+
+	ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		printf("mmap() fail\n");
+		return 1;
+	}
+	data = (unsigned char *)ring + ring->data_offset;
+
+	if (argv[1][1] == 'p') {
+		produce(fd, argc > 2 ? atol(argv[2]) : 1000000);
+	} else {
+		if (argc > 2) {
+			struct globalfifo_watermark wm = {
+				.read_wm = atoi(argv[2]),
+				.write_wm = ring->write_wm,
+			};
+
+			if (ioctl(fd, FIFO_SET_WATERMARK, &wm) < 0)
+				printf("fail to set read watermark %u\n", wm.read_wm);
+		}
+		consume(fd);
+	}
+
+	munmap(ring, len);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * globalfifo 页模式splice测试
+ * 模块以 fifo_mode=5 加载，global_mem_0 工作在页模式：
+ *	./globalfifo_splice -p [-n MB]		生产者，vmsplice用户页到管道，再splice到设备
+ *	./globalfifo_splice -c [-n MB] [-o 文件]	消费者，从设备splice到管道，再splice到文件(默认/dev/null)
+ * 加上 -r 改用read/write，对比拷贝两次时的吞吐量
+ *
+ * vmsplice之后fifo引用的是生产者自己的页，读走之前不能修改，
+ * 所以生产者每一块都mmap新的页，vmsplice之后就munmap，页由fifo和管道的引用保持
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define CHUNK (64 * 1024)	/* 默认的管道是16个页 */
+
+static const char *dev_name = "/dev/global_mem_0";
+static int use_rw;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 把管道中的len字节都splice到fd，splice一次可能只搬一部分 */
+static int splice_all(int pipefd, int fd, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = splice(pipefd, NULL, fd, NULL, len, SPLICE_F_MOVE);
+		if (ret <= 0) {
+			perror("splice");
+			return -1;
+		}
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int produce(int fd, long total)
+{
+	struct iovec iov;
+	char *buf;
+	long done;
+	ssize_t ret;
+	int pfd[2];
+
+	if (pipe(pfd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	for (done = 0; done < total; done += CHUNK) {
+		buf = mmap(NULL, CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		memset(buf, 'a' + (done / CHUNK) % 26, CHUNK);
+
+		if (use_rw) {
+			for (iov.iov_len = 0; iov.iov_len < CHUNK; iov.iov_len += ret) {
+				ret = write(fd, buf + iov.iov_len, CHUNK - iov.iov_len);
+				if (ret <= 0) {
+					perror("write");
+					return -1;
+				}
+			}
+		} else {
+			/* 管道是空的，一次vmsplice可以放下16个页 */
+			iov.iov_base = buf;
+			iov.iov_len = CHUNK;
+			if (vmsplice(pfd[1], &iov, 1, SPLICE_F_GIFT) != CHUNK) {
+				perror("vmsplice");
+				return -1;
+			}
+			if (splice_all(pfd[0], fd, CHUNK) < 0)
+				return -1;
+		}
+
+		munmap(buf, CHUNK);
+	}
+
+	close(pfd[0]);
+	close(pfd[1]);
+	return 0;
+}
+
+static long consume(int fd, int out, long total)
+{
+	char *buf = malloc(CHUNK);
+	long done = 0;
+	ssize_t ret;
+	int pfd[2];
+
+	if (!buf || pipe(pfd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	while (done < total) {
+		if (use_rw) {
+			ret = read(fd, buf, CHUNK);
+			if (ret > 0 && write(out, buf, ret) != ret) {
+				perror("write");
+				break;
+			}
+		} else {
+			ret = splice(fd, NULL, pfd[1], NULL, CHUNK, SPLICE_F_MOVE);
+			if (ret > 0 && splice_all(pfd[0], out, ret) < 0)
+				break;
+		}
+		if (ret <= 0)
+			break;
+
+		/* 每读到16MB打印一次 */
+		if ((done + ret) >> 24 != done >> 24)
+			printf("consumed %ld MB\n", (done + ret) >> 20);
+		done += ret;
+	}
+
+	free(buf);
+	return done;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *out_name = "/dev/null";
+	long total = 1024;
+	int producer = -1, opt, fd, out;
+	double begin;
+
+	while ((opt = getopt(argc, argv, "pcn:o:d:r")) != -1) {
+		switch (opt) {
+		case 'p':
+			producer = 1;
+			break;
+		case 'c':
+			producer = 0;
+			break;
+		case 'n':
+			total = atol(optarg);
+			break;
+		case 'o':
+			out_name = optarg;
+			break;
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 'r':
+			use_rw = 1;
+			break;
+		default:
+			producer = -1;
+			break;
+		}
+	}
+
+	if (producer < 0 || total <= 0) {
+		printf("usage: %s -p [-n MB] | -c [-n MB] [-o file] [-d dev] [-r]\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(dev_name, producer ? O_WRONLY : O_RDONLY);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return 1;
+	}
+
+	begin = now();
+	if (producer) {
+		total <<= 20;
+		if (produce(fd, total) < 0)
+			return 1;
+	} else {
+		out = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out == -1) {
+			printf("fail to open %s\n", out_name);
+			return 1;
+		}
+		total = consume(fd, out, total << 20);
+		close(out);
+	}
+
+	printf("%s %ld byte(s) in %.2f s, %.1f MB/s\n", producer ? "produced" : "consumed", total,
+	       now() - begin, total / (now() - begin) / (1024 * 1024));
+
+	close(fd);
+	return 0;
+}
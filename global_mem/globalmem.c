@@ -2,33 +2,124 @@
 #include <linux/cdev.h>
 #include <linux/slab.h>			/* for kzalloc() */
 #include <linux/uaccess.h>		/* for copy_from(to)_user */
+#include <linux/mm.h>			/* for vm_operations_struct */
+#include <linux/xarray.h>		/* for xa_load() */
+#include <linux/highmem.h>		/* for zero_user_segment() */
+#include <linux/uio.h>			/* for iov_iter */
+#include <linux/fs.h>			/* for generic_file_splice_read() */
+#include <linux/page-flags.h>		/* for SetPageUptodate() */
 
 #define GLOBALMEM_SIZE 4096
+#define GLOBALMEM_MAX_SIZE ((loff_t)64 << 30)	/* 单个设备最大64G */
 #define DEVICE_NUM 4
+#define GLOBALMEM_LOCK_SHARDS 64	/* 页锁分片的个数，必须是2的幂 */
 #define GLOBAL_MEM_MAGIC 'g'
 #define MEM_CLEAR _IO(GLOBAL_MEM_MAGIC, 0)
+#define MEM_SET_SIZE _IOW(GLOBAL_MEM_MAGIC, 1, __u64)
+#define MEM_GET_SIZE _IOR(GLOBAL_MEM_MAGIC, 2, __u64)
 
 static struct class *globalmem_class;
 static char *chr_dev_name[20] = {"global_mem_0", "global_mem_1", "global_mem_2", "global_mem_3"};
 
-
+/* 每个设备的默认容量，可以在加载模块时指定，也可以用MEM_SET_SIZE单独修改 */
+static unsigned long long mem_size = GLOBALMEM_SIZE;
+module_param(mem_size, ullong, 0444);
 
 struct global_mem_dev {
 	struct cdev cdev;
-	unsigned char mem[GLOBALMEM_SIZE];
-	struct mutex mutex;
+	struct xarray pages;		/* 按页号索引的稀疏页数组，没写过的页不占内存 */
+	loff_t size;			/* 设备容量 */
+	atomic_t mmap_count;		/* 映射的个数，有映射时不允许修改容量 */
+	struct rw_semaphore rwsem;	/* 读写时持有读锁，修改容量和清零时持有写锁 */
+	/*
+	 * 按页号分片的读写锁，读进程之间互不阻塞，
+	 * 写不同页的写进程也可以并行，只有访问同一分片时才会互斥
+	 */
+	struct rw_semaphore page_lock[GLOBALMEM_LOCK_SHARDS];
 };
 
 struct global_mem_dev *global_mem_devp;
 
 dev_t devno; /* 为了在init和exit函数中使用，要用到全局变量 */
 
+/*
+ * 取出index对应的页，gfp不为0时如果页还不存在就按gfp申请一页
+ * 缺页处理不持有锁，所以用xa_cmpxchg插入，插入失败说明已经被别人抢先插入了
+ */
+static struct page *global_mem_get_page(struct global_mem_dev *dev, pgoff_t index, gfp_t gfp)
+{
+	struct page *page, *old;
+
+	page = xa_load(&dev->pages, index);
+	if (page || !gfp)
+		return page;
+
+	page = alloc_page(gfp | __GFP_HIGHMEM | __GFP_ZERO);
+	if (!page)
+		return NULL;
+
+	/*
+	 * splice_read把页按引用放进pipe，pipe缓冲区的confirm要求页是uptodate的，
+	 * 否则会因为页不属于任何address_space而返回-ENODATA
+	 */
+	SetPageUptodate(page);
+
+	old = xa_cmpxchg(&dev->pages, index, NULL, page, gfp);
+	if (old) {
+		__free_page(page);
+		return xa_is_err(old) ? NULL : old;
+	}
+
+	return page;
+}
+
+/* IOCB_NOWAIT时只尝试加锁，拿不到锁就返回-EAGAIN，不能睡眠 */
+static inline bool global_mem_down_read(struct rw_semaphore *sem, bool nowait)
+{
+	if (nowait)
+		return down_read_trylock(sem);
+
+	down_read(sem);
+	return true;
+}
+
+static inline bool global_mem_down_write(struct rw_semaphore *sem, bool nowait)
+{
+	if (nowait)
+		return down_write_trylock(sem);
+
+	down_write(sem);
+	return true;
+}
+
+/* 相邻的页落在不同的分片上，顺序读写大块数据时不会总是和同一个进程冲突 */
+static inline struct rw_semaphore *global_mem_page_lock(struct global_mem_dev *dev, pgoff_t index)
+{
+	return &dev->page_lock[index & (GLOBALMEM_LOCK_SHARDS - 1)];
+}
+
+/* 释放从start页开始的所有页 */
+static void global_mem_free_pages(struct global_mem_dev *dev, pgoff_t start)
+{
+	unsigned long index = start;
+	struct page *page;
+
+	for (page = xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT); page;
+	     page = xa_find_after(&dev->pages, &index, ULONG_MAX, XA_PRESENT)) {
+		xa_erase(&dev->pages, index);
+		put_page(page);
+	}
+}
+
 int global_mem_open(struct inode *inode, struct file *filp)
 {
 	/* 在设备驱动中默认将设备指针挂接在文件的私有数据中，在后续只需要对文件的私有数据进行操作即可 */
 	//filp->private_data = global_mem_devp;
 	struct global_mem_dev *dev = container_of(inode->i_cdev, struct global_mem_dev, cdev);
 	filp->private_data = dev;
+
+	/* 支持preadv2/pwritev2的RWF_NOWAIT，io_uring也可以直接在提交时完成 */
+	filp->f_mode |= FMODE_NOWAIT;
 	return 0;
 }
 
@@ -37,117 +128,225 @@ int global_mem_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
-static ssize_t global_mem_read(struct file *filp, char __user *buf, size_t size, loff_t *ppos)
+/*
+ * 基于iov_iter的读，read/readv/preadv2/io_uring都会走到这里，
+ * 一次系统调用可以把设备的多个区域读到多个用户缓冲区
+ */
+static ssize_t global_mem_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	unsigned long p = *ppos;
-	unsigned int count = size;
-	int ret = 0;
-	struct global_mem_dev *dev = filp->private_data;
-
-	if (p >= GLOBALMEM_SIZE)
-		return 0;
-
-	if (count > GLOBALMEM_SIZE - p) {
-		count = GLOBALMEM_SIZE - p;
+	struct global_mem_dev *dev = iocb->ki_filp->private_data;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	loff_t p = iocb->ki_pos;
+	size_t count = iov_iter_count(to);
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	if (!global_mem_down_read(&dev->rwsem, nowait))
+		return -EAGAIN;
+
+	if (p >= dev->size)
+		goto out;
+
+	if (count > dev->size - p)
+		count = dev->size - p;
+
+	/* 按页拷贝，一次最多拷贝到当前页的末尾，只持有这一页所在分片的读锁 */
+	while (done < count) {
+		pgoff_t index = (p + done) >> PAGE_SHIFT;
+		unsigned int offset = (p + done) & ~PAGE_MASK;
+		size_t len = min_t(size_t, PAGE_SIZE - offset, count - done);
+		struct rw_semaphore *lock = global_mem_page_lock(dev, index);
+		struct page *page;
+		size_t copied;
+
+		if (!global_mem_down_read(lock, nowait)) {
+			ret = -EAGAIN;
+			break;
+		}
+		page = global_mem_get_page(dev, index, 0);
+		/* 没有写过的页读出来全是0 */
+		if (page)
+			copied = copy_page_to_iter(page, offset, len, to);
+		else
+			copied = iov_iter_zero(len, to);
+		up_read(lock);
+
+		done += copied;
+		if (copied < len) {
+			ret = -EFAULT;
+			break;
+		}
 	}
 
-	mutex_lock(&dev->mutex);
-	if (copy_to_user(buf, dev->mem + p, count)) {
-		ret = -EFAULT;
-	} else {
-		*ppos += count;
-		ret = count;
-		printk(KERN_INFO "read %u byte(s) from %lu\n", count, p);
+	/* 只要读到了一部分，就返回读到的字节数 */
+	if (done) {
+		iocb->ki_pos += done;
+		ret = done;
+		pr_debug("read %zu byte(s) from %lld\n", done, p);
 	}
-	mutex_unlock(&dev->mutex);
-	
+
+out:
+	up_read(&dev->rwsem);
+
 	return ret;
 }
 
-static ssize_t global_mem_write(struct file *filp, const char __user *buf, size_t size, loff_t *ppos)
+static ssize_t global_mem_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	unsigned long p = *ppos;
-	unsigned int count = size;
-	int ret  = 0;
-	struct global_mem_dev *dev = filp->private_data;
+	struct global_mem_dev *dev = iocb->ki_filp->private_data;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	loff_t p = iocb->ki_pos;
+	size_t count = iov_iter_count(from);
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	if (!global_mem_down_read(&dev->rwsem, nowait))
+		return -EAGAIN;
+
+	if (p >= dev->size)
+		goto out;
+
+	if (count > dev->size - p)
+		count = dev->size - p;
+
+	/* 写进程只持有当前页所在分片的写锁，写不同页的进程可以并行 */
+	while (done < count) {
+		pgoff_t index = (p + done) >> PAGE_SHIFT;
+		unsigned int offset = (p + done) & ~PAGE_MASK;
+		size_t len = min_t(size_t, PAGE_SIZE - offset, count - done);
+		struct rw_semaphore *lock = global_mem_page_lock(dev, index);
+		struct page *page;
+		size_t copied;
+
+		if (!global_mem_down_write(lock, nowait)) {
+			ret = -EAGAIN;
+			break;
+		}
 
-	if (p > GLOBALMEM_SIZE) {
-		return 0;
-	}
+		/* 非阻塞时申请页也不能睡眠，申请不到就让调用者以阻塞方式重试 */
+		page = global_mem_get_page(dev, index, nowait ? GFP_NOWAIT : GFP_KERNEL);
+		if (!page) {
+			up_write(lock);
+			ret = nowait ? -EAGAIN : -ENOMEM;
+			break;
+		}
 
-	if (count > GLOBALMEM_SIZE - p) {
-		count = GLOBALMEM_SIZE - p;
+		copied = copy_page_from_iter(page, offset, len, from);
+		up_write(lock);
+
+		done += copied;
+		if (copied < len) {
+			ret = -EFAULT;
+			break;
+		}
 	}
 
-	mutex_lock(&dev->mutex);
-	if (copy_from_user(dev->mem + p, buf, count)) {
-		return -EFAULT;
-	} else {
-		*ppos += count;
-		ret = count;
-		printk(KERN_INFO "write %u byte(s) from %lu\n", count, p);
+	/* 只要写进去了一部分，就返回写入的字节数 */
+	if (done) {
+		iocb->ki_pos += done;
+		ret = done;
+		pr_debug("write %zu byte(s) from %lld\n", done, p);
 	}
-	mutex_unlock(&dev->mutex);
-	
+
+out:
+	up_read(&dev->rwsem);
+
 	return ret;
 }
 
 static loff_t global_mem_llseek(struct file * filp, loff_t offset, int orig)
 {
 	loff_t ret = 0;
-	switch (orig) {
-	case 0:
-		if (offset < 0) {
-			ret = -EINVAL;
-			break;
-		}
-		
-		if ((unsigned int)offset > GLOBALMEM_SIZE) {
-			ret = -EINVAL;
-			break;
-		}
+	struct global_mem_dev *dev = filp->private_data;
 
+	switch (orig) {
+	case SEEK_SET:
 		/* 表示文件从头开始seek */
-		filp->f_pos = (unsigned int)offset; 
-		ret = filp->f_pos;
+		ret = offset;
 		break;
-		
-	case 1:
-		if ((filp->f_pos + offset) > GLOBALMEM_SIZE) {
-			ret = -EINVAL;
-			break;
-		}
-
-		if ((filp->f_pos + offset) < 0) {
-			ret = -EINVAL;
-			break;
-		}
 
+	case SEEK_CUR:
 		/* 表示文件从当前位置开始seek */
-		filp->f_pos += offset;
-		ret = filp->f_pos;
+		ret = filp->f_pos + offset;
 		break;
 
-	default:
-		ret = -EINVAL;
+	case SEEK_END:
+		/* 表示文件从设备末尾开始seek */
+		ret = dev->size + offset;
 		break;
-	}	
+
+	default:
+		return -EINVAL;
+	}
+
+	if (ret < 0 || ret > dev->size)
+		return -EINVAL;
+
+	filp->f_pos = ret;
 
 	return ret;
 }
 
+/* 修改设备容量，缩小时释放超出部分的页，并把最后一页多出来的部分清零 */
+static int global_mem_resize(struct global_mem_dev *dev, loff_t size)
+{
+	struct page *page;
+
+	if (size <= 0 || size > GLOBALMEM_MAX_SIZE)
+		return -EINVAL;
+
+	if (atomic_read(&dev->mmap_count))
+		return -EBUSY;
+
+	if (size < dev->size) {
+		global_mem_free_pages(dev, DIV_ROUND_UP(size, PAGE_SIZE));
+
+		page = global_mem_get_page(dev, size >> PAGE_SHIFT, 0);
+		if (page)
+			zero_user_segment(page, size & ~PAGE_MASK, PAGE_SIZE);
+	}
+	dev->size = size;
+
+	return 0;
+}
+
 long global_mem_ioctl(struct file *filp, unsigned int cmd, unsigned long args)
 {
 	long ret = 0;
 	struct global_mem_dev *dev = filp->private_data;
-	
+	unsigned long index;
+	struct page *page;
+	__u64 size;
+
 	switch (cmd){
 	case MEM_CLEAR:
-		mutex_lock(&dev->mutex);
-		memset(dev->mem, 0, GLOBALMEM_SIZE);
-		mutex_unlock(&dev->mutex);
+		down_write(&dev->rwsem);
+		/* 没有映射时直接释放所有页，有映射时只能原地清零，保证映射看到的还是设备内存 */
+		if (atomic_read(&dev->mmap_count)) {
+			xa_for_each(&dev->pages, index, page)
+				clear_highpage(page);
+		} else {
+			global_mem_free_pages(dev, 0);
+		}
+		up_write(&dev->rwsem);
 		printk(KERN_INFO "global mem is set to zer0\n");
 		break;
+	case MEM_SET_SIZE:
+		if (copy_from_user(&size, (void __user *)args, sizeof(size)))
+			return -EFAULT;
+
+		if (size > GLOBALMEM_MAX_SIZE)
+			return -EINVAL;
+
+		down_write(&dev->rwsem);
+		ret = global_mem_resize(dev, size);
+		up_write(&dev->rwsem);
+		break;
+	case MEM_GET_SIZE:
+		size = dev->size;
+		if (copy_to_user((void __user *)args, &size, sizeof(size)))
+			ret = -EFAULT;
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -155,14 +354,93 @@ long global_mem_ioctl(struct file *filp, unsigned int cmd, unsigned long args)
 	return ret;
 }
 
+/*
+ * 缺页时才把设备内存对应的页填到用户页表中，页不存在时就申请一页
+ * get_page()增加页的引用计数，munmap时由内核put_page()
+ */
+static vm_fault_t global_mem_vm_fault(struct vm_fault *vmf)
+{
+	struct global_mem_dev *dev = vmf->vma->vm_private_data;
+	struct page *page;
+
+	if (vmf->pgoff >= DIV_ROUND_UP(dev->size, PAGE_SIZE))
+		return VM_FAULT_SIGBUS;
+
+	page = global_mem_get_page(dev, vmf->pgoff, GFP_KERNEL);
+	if (!page)
+		return VM_FAULT_OOM;
+
+	get_page(page);
+	vmf->page = page;
+
+	return 0;
+}
+
+/* fork和拆分vma时会调用open，统计映射的个数 */
+static void global_mem_vm_open(struct vm_area_struct *vma)
+{
+	struct global_mem_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->mmap_count);
+}
+
+static void global_mem_vm_close(struct vm_area_struct *vma)
+{
+	struct global_mem_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->mmap_count);
+}
+
+static const struct vm_operations_struct global_mem_vm_ops = {
+	.open = global_mem_vm_open,
+	.close = global_mem_vm_close,
+	.fault = global_mem_vm_fault,
+};
+
+static int global_mem_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct global_mem_dev *dev = filp->private_data;
+	unsigned long pages = vma_pages(vma);
+	unsigned long dev_pages;
+	int ret = 0;
+
+	down_read(&dev->rwsem);
+
+	/* 映射的范围不能超出设备内存 */
+	dev_pages = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	if (vma->vm_pgoff >= dev_pages || pages > dev_pages - vma->vm_pgoff) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* 不允许mremap扩大映射，也不需要出现在core dump中 */
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &global_mem_vm_ops;
+	vma->vm_private_data = dev;
+	global_mem_vm_open(vma);
+
+out:
+	up_read(&dev->rwsem);
+
+	return ret;
+}
+
 struct file_operations global_mem_fops = {
 	.owner = THIS_MODULE,
 	.open = global_mem_open,
 	.release = global_mem_release,
-	.read = global_mem_read,
-	.write = global_mem_write,
+	.read_iter = global_mem_read_iter,
+	.write_iter = global_mem_write_iter,
+	/*
+	 * splice_read通过read_iter向ITER_PIPE拷贝，copy_page_to_iter对pipe只是
+	 * get_page()后把页挂到pipe上，不拷贝数据，sendfile到socket或文件时零拷贝。
+	 * 注意pipe中的页和设备共享，数据被消费之前设备被改写，读到的是新的数据
+	 */
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = global_mem_ioctl,
 	.llseek = global_mem_llseek,
+	.mmap = global_mem_mmap,
 };
 
 
@@ -170,6 +448,7 @@ static int __init global_mem_init(void)
 {
 	int ret = 0;
 	int i = 0;
+	int j = 0;
 	struct global_mem_dev *global_mem_devp_tmp;
 
 	/* 向内核申请设备号,申请多个设备(DEVICE_NUM)，共用主设备号 */
@@ -179,6 +458,12 @@ static int __init global_mem_init(void)
 	}
 	printk(KERN_INFO "chrdev alloc success, major:%d, minor:%d\n", MAJOR(devno), MINOR(devno));
 
+	if (!mem_size || mem_size > GLOBALMEM_MAX_SIZE) {
+		printk(KERN_INFO "invalid mem_size %llu\n", mem_size);
+		ret = -EINVAL;
+		goto fail_malloc;
+	}
+
 	/* 把设备添加到内核 */
 	global_mem_devp = (struct global_mem_dev *)kzalloc(sizeof(struct global_mem_dev)* DEVICE_NUM, GFP_KERNEL);
 	if (!global_mem_devp) {
@@ -189,7 +474,12 @@ static int __init global_mem_init(void)
 	/* 将设备注册到内核 在c语言中->优先级高于&*/
 	global_mem_devp_tmp = global_mem_devp;
 	for (i = 0; i < DEVICE_NUM; i++) {
-		mutex_init(&(global_mem_devp_tmp + i)->mutex);
+		/* 设备内存在第一次写入或者缺页时才按页申请 */
+		xa_init(&(global_mem_devp_tmp + i)->pages);
+		(global_mem_devp_tmp + i)->size = mem_size;
+		init_rwsem(&(global_mem_devp_tmp + i)->rwsem);
+		for (j = 0; j < GLOBALMEM_LOCK_SHARDS; j++)
+			init_rwsem(&(global_mem_devp_tmp + i)->page_lock[j]);
 		cdev_init(&(global_mem_devp_tmp + i)->cdev, &global_mem_fops);
 		ret = cdev_add(&(global_mem_devp_tmp + i)->cdev, MKDEV(MAJOR(devno), i), 1);
 		if (ret)
@@ -219,8 +509,10 @@ static void __exit global_mem_exit(void)
 {
 	int i = 0;
 	
-	for (i = 0; i < DEVICE_NUM; i++)
+	for (i = 0; i < DEVICE_NUM; i++) {
 		cdev_del(&(global_mem_devp + i)->cdev);
+		global_mem_free_pages(global_mem_devp + i, 0);
+	}
 
 	kfree(global_mem_devp);
 	unregister_chrdev_region(devno, DEVICE_NUM);
@@ -0,0 +1,202 @@
+/*
+ * globalmem 多线程 pread/pwrite 扩展性测试
+ *
+ * 每个线程只访问自己的一段区域，统计不同线程数下的吞吐量：
+ *	./globalmem_bench [-d /dev/global_mem_0] [-t 最大线程数] [-b 块大小]
+ *			  [-m read|write|mixed] [-s 每轮秒数]
+ *
+ * 设备容量要足够大，可以先用 mem_size=64M 加载模块
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define GLOBAL_MEM_MAGIC 'g'
+#define MEM_GET_SIZE _IOR(GLOBAL_MEM_MAGIC, 2, uint64_t)
+
+enum {
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_MIXED,
+};
+
+static const char *dev_name = "/dev/global_mem_0";
+static int max_threads = 8;
+static size_t block_size = 4096;
+static int mode = BENCH_READ;
+static int seconds = 3;
+static uint64_t dev_size;
+
+static volatile int stop;
+
+struct bench_thread {
+	pthread_t tid;
+	int fd;
+	off_t start;		/* 线程独占区域的起始偏移 */
+	off_t len;		/* 线程独占区域的长度 */
+	unsigned long ops;
+	int err;
+};
+
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *t = arg;
+	char *buf = malloc(block_size);
+	off_t off = 0;
+	ssize_t ret;
+
+	if (!buf) {
+		t->err = 1;
+		return NULL;
+	}
+	memset(buf, 0x5a, block_size);
+
+	while (!stop) {
+		/* mixed模式下读写各一半 */
+		if (mode == BENCH_WRITE || (mode == BENCH_MIXED && (t->ops & 1)))
+			ret = pwrite(t->fd, buf, block_size, t->start + off);
+		else
+			ret = pread(t->fd, buf, block_size, t->start + off);
+
+		if (ret != (ssize_t)block_size) {
+			t->err = 1;
+			break;
+		}
+
+		t->ops++;
+		off += block_size;
+		if (off + (off_t)block_size > t->len)
+			off = 0;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(int nthreads)
+{
+	struct bench_thread *threads = calloc(nthreads, sizeof(*threads));
+	off_t len = dev_size / nthreads / block_size * block_size;
+	unsigned long ops = 0;
+	double begin, elapsed;
+	int i, err = 0;
+
+	if (!threads || len < (off_t)block_size) {
+		printf("device too small for %d threads\n", nthreads);
+		free(threads);
+		return -1;
+	}
+
+	stop = 0;
+	for (i = 0; i < nthreads; i++) {
+		/* 每个线程单独打开设备，避免共享file的f_pos */
+		threads[i].fd = open(dev_name, O_RDWR);
+		threads[i].start = i * len;
+		threads[i].len = len;
+		if (threads[i].fd == -1) {
+			printf("fail to open %s\n", dev_name);
+			err = -1;
+			nthreads = i;
+			goto out;
+		}
+	}
+
+	begin = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i].tid, NULL, bench_worker, &threads[i]);
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ops += threads[i].ops;
+		err |= threads[i].err;
+	}
+	elapsed = now() - begin;
+
+	printf("%8d %14.0f %12.1f%s\n", nthreads, ops / elapsed,
+	       ops * block_size / elapsed / (1024 * 1024), err ? "  (I/O error)" : "");
+
+out:
+	for (i = 0; i < nthreads; i++)
+		close(threads[i].fd);
+	free(threads);
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, opt, n;
+
+	while ((opt = getopt(argc, argv, "d:t:b:m:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "write"))
+				mode = BENCH_WRITE;
+			else if (!strcmp(optarg, "mixed"))
+				mode = BENCH_MIXED;
+			else
+				mode = BENCH_READ;
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-d dev] [-t threads] [-b block] [-m read|write|mixed] [-s sec]\n",
+			       argv[0]);
+			return 1;
+		}
+	}
+
+	if (max_threads <= 0 || !block_size || seconds <= 0) {
+		printf("invalid arguments\n");
+		return 1;
+	}
+
+	fd = open(dev_name, O_RDWR);
+	if (fd == -1) {
+		printf("fail to open %s\n", dev_name);
+		return 1;
+	}
+	if (ioctl(fd, MEM_GET_SIZE, &dev_size) < 0) {
+		printf("ioctl MEM_GET_SIZE failed\n");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("device %s, size %llu, block %zu, mode %s\n", dev_name,
+	       (unsigned long long)dev_size, block_size,
+	       mode == BENCH_READ ? "read" : mode == BENCH_WRITE ? "write" : "mixed");
+	printf("%8s %14s %12s\n", "threads", "ops/s", "MB/s");
+
+	for (n = 1; n <= max_threads; n *= 2)
+		if (run(n))
+			return 1;
+
+	return 0;
+}
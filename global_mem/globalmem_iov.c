@@ -0,0 +1,44 @@
+#define _GNU_SOURCE		/* for preadv2 */
+#include <stdio.h>		/* for printf */
+#include <errno.h>
+#include <fcntl.h>		/* for O_RDWR */
+#include <unistd.h>
+#include <sys/uio.h>		/* for struct iovec */
+
+void main(void)
+{
+	int fd;
+	ssize_t ret;
+	char head[8], body[16], tail[8];
+	struct iovec wiov[3] = {
+		{ .iov_base = "HEAD0001", .iov_len = 8 },
+		{ .iov_base = "body of message!", .iov_len = 16 },
+		{ .iov_base = "TAIL0001", .iov_len = 8 },
+	};
+	struct iovec riov[3] = {
+		{ .iov_base = head, .iov_len = sizeof(head) },
+		{ .iov_base = body, .iov_len = sizeof(body) },
+		{ .iov_base = tail, .iov_len = sizeof(tail) },
+	};
+
+	fd = open("/dev/global_mem_0", O_RDWR);
+	if (fd == -1) {
+		printf("fail to open device.\n");
+		return;
+	}
+
+	/* 一次系统调用把3个缓冲区写到设备偏移0开始的位置 */
+	ret = pwritev(fd, wiov, 3, 0);
+	printf("pwritev return %zd\n", ret);
+
+	/* 非阻塞方式读回，设备正忙时返回EAGAIN，再以阻塞方式重试 */
+	ret = preadv2(fd, riov, 3, 0, RWF_NOWAIT);
+	if (ret < 0 && errno == EAGAIN) {
+		printf("preadv2 RWF_NOWAIT would block, retry\n");
+		ret = preadv2(fd, riov, 3, 0, 0);
+	}
+	printf("preadv2 return %zd\n", ret);
+	printf("head:%.8s body:%.16s tail:%.8s\n", head, body, tail);
+
+	close(fd);
+}
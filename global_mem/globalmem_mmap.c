@@ -0,0 +1,40 @@
+#include <stdio.h>		/* for printf */
+#include <string.h>
+#include <fcntl.h>		/* for O_RDWR */
+#include <unistd.h>		/* for write */
+#include <sys/mman.h>		/* for mmap */
+
+#define GLOBALMEM_SIZE 4096
+
+void main(void)
+{
+	int fd;
+	char *mem;
+
+	fd = open("/dev/global_mem_0", O_RDWR);
+	if (fd == -1) {
+		printf("fail to open device.\n");
+		return;
+	}
+
+	/* 把设备内存映射到用户空间，之后的访问不再需要系统调用 */
+	mem = mmap(NULL, GLOBALMEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		printf("mmap() fail\n");
+		close(fd);
+		return;
+	}
+
+	/* 通过write写入的数据，可以直接在映射中看到 */
+	write(fd, "hello globalmem", 15);
+	printf("mmap read: %.15s\n", mem);
+
+	/* 通过映射写入的数据，可以直接通过read读到 */
+	strcpy(mem, "written by mmap");
+	lseek(fd, 0, SEEK_SET);
+	read(fd, mem + 64, 15);
+	printf("read back: %.15s\n", mem + 64);
+
+	munmap(mem, GLOBALMEM_SIZE);
+	close(fd);
+}
@@ -0,0 +1,38 @@
+#include <stdio.h>		/* for printf */
+#include <stdlib.h>		/* for atoll */
+#include <fcntl.h>		/* for O_RDONLY */
+#include <unistd.h>
+#include <sys/sendfile.h>	/* for sendfile */
+
+/*
+ * 把globalmem的内容用sendfile发送到标准输出，标准输出可以是文件、pipe或者socket:
+ *	./globalmem_sendfile 4096 > snapshot.bin
+ *	./globalmem_sendfile 4096 | nc 192.168.0.2 8000
+ */
+void main(int argc, char *argv[])
+{
+	int fd;
+	off_t off = 0;
+	size_t count = argc > 1 ? atoll(argv[1]) : 4096;
+	ssize_t ret;
+
+	fd = open("/dev/global_mem_0", O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "fail to open device.\n");
+		return;
+	}
+
+	/* 数据在内核中从设备的页直接交给输出端，不经过用户空间 */
+	while (count) {
+		ret = sendfile(STDOUT_FILENO, fd, &off, count);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("sendfile");
+			break;
+		}
+		count -= ret;
+	}
+
+	fprintf(stderr, "sendfile %lld byte(s)\n", (long long)off);
+	close(fd);
+}
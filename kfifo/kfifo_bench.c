@@ -0,0 +1,174 @@
+/*
+ * bytestream-fifo throughput benchmark
+ *
+ * one writer thread and one reader thread move data through /proc/bytestream-fifo
+ * with different chunk sizes, load the module with and without lockless=1 to compare:
+ *	insmod kfifo_demo_static.ko fifo_size=65536 lockless=1
+ *	./kfifo_bench [-s seconds] [-m max chunk] [-b backoff us]
+ *
+ * read returns 0 on an empty fifo and write returns 0 on a full one, both threads
+ * just retry, ops/s only counts the calls that moved some data
+ *
+ * to compare the DMA path with kfifo_to_user for large buffers:
+ *	insmod kfifo_demo_static.ko fifo_size=4194304 use_dma=1
+ *	./kfifo_bench -m 1048576
+ * cpu% is the user + system time of both threads per second, the DMA path sleeps
+ * while the engine copies; add -b to sleep instead of spinning on an empty or
+ * full fifo, otherwise the spinning hides the difference
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define PROC_FIFO "/proc/bytestream-fifo"
+
+static volatile int stop;
+static size_t chunk;
+static int backoff;	/* us to sleep when the fifo is empty or full, 0 to sched_yield */
+
+static void retry(void)
+{
+	if (backoff)
+		usleep(backoff);
+	else
+		sched_yield();
+}
+
+struct bench_thread {
+	pthread_t tid;
+	unsigned long ops;
+	unsigned long bytes;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* user + system CPU time of the whole process */
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *writer(void *arg)
+{
+	struct bench_thread *t = arg;
+	char *buf = calloc(1, chunk);
+	ssize_t ret;
+	int fd;
+
+	fd = open(PROC_FIFO, O_WRONLY);
+	if (fd == -1 || !buf) {
+		printf("fail to open %s\n", PROC_FIFO);
+		return NULL;
+	}
+
+	while (!stop) {
+		ret = write(fd, buf, chunk);
+		if (ret > 0) {
+			t->ops++;
+			t->bytes += ret;
+		} else {
+			retry();
+		}
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct bench_thread *t = arg;
+	char *buf = malloc(chunk);
+	ssize_t ret;
+	int fd;
+
+	fd = open(PROC_FIFO, O_RDONLY);
+	if (fd == -1 || !buf) {
+		printf("fail to open %s\n", PROC_FIFO);
+		return NULL;
+	}
+
+	while (!stop) {
+		ret = read(fd, buf, chunk);
+		if (ret > 0) {
+			t->ops++;
+			t->bytes += ret;
+		} else {
+			retry();
+		}
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread w, r;
+	size_t max_chunk = 65536;
+	int seconds = 2, opt;
+	double begin, elapsed, cpu;
+
+	while ((opt = getopt(argc, argv, "s:m:b:")) != -1) {
+		switch (opt) {
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			max_chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			backoff = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-s seconds] [-m max chunk] [-b backoff us]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (seconds <= 0 || !max_chunk) {
+		printf("invalid arguments\n");
+		return 1;
+	}
+
+	printf("%10s %14s %14s %14s %8s\n", "chunk", "writes/s", "reads/s", "MB/s", "cpu%");
+
+	for (chunk = 16; chunk <= max_chunk; chunk *= 4) {
+		w = (struct bench_thread){ 0 };
+		r = (struct bench_thread){ 0 };
+		stop = 0;
+
+		begin = now();
+		cpu = cpu_time();
+		pthread_create(&r.tid, NULL, reader, &r);
+		pthread_create(&w.tid, NULL, writer, &w);
+		sleep(seconds);
+		stop = 1;
+		pthread_join(w.tid, NULL);
+		pthread_join(r.tid, NULL);
+		elapsed = now() - begin;
+		cpu = cpu_time() - cpu;
+
+		printf("%10zu %14.0f %14.0f %14.1f %8.0f\n", chunk, w.ops / elapsed, r.ops / elapsed,
+		       r.bytes / elapsed / (1024 * 1024), cpu * 100 / elapsed);
+	}
+
+	return 0;
+}
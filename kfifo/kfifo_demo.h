@@ -0,0 +1,32 @@
+/*
+ * element layout of /proc/bytestream-fifo, shared by the module and user space
+ */
+#ifndef _KFIFO_DEMO_H
+#define _KFIFO_DEMO_H
+
+#include <linux/types.h>
+
+/* fifo_type module parameter */
+#define FIFO_TYPE_BYTE	0	/* byte stream, the original demo */
+#define FIFO_TYPE_ELEM	1	/* fixed size struct fifo_elem elements, no framing */
+#define FIFO_TYPE_REC1	2	/* variable length records, 1 byte length, at most 255 bytes */
+#define FIFO_TYPE_REC2	3	/* variable length records, 2 byte length, at most 65535 bytes */
+
+/*
+ * a fixed 64 byte telemetry sample, FIFO_TYPE_ELEM reads and writes whole
+ * elements only, a read returns as many as fit into the buffer
+ */
+struct fifo_elem {
+	__u64 ts;
+	__u32 id;
+	__u32 seq;
+	__u8 payload[48];
+};
+
+/*
+ * FIFO_TYPE_REC1/REC2: a write is one record, a read returns as many whole
+ * records as fit into the buffer, each one prefixed by a __u16 length
+ */
+#define FIFO_REC_HDR	sizeof(__u16)
+
+#endif /* _KFIFO_DEMO_H */
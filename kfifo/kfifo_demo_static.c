@@ -11,6 +11,13 @@
 #include <linux/module.h>
 #include <linux/kfifo.h>
 #include <linux/proc_fs.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/completion.h>
+#include <linux/mm.h>
+
+#include "kfifo_demo.h"
 
 /* name of the proc entry */
 #define PROC_FIFO "bytestream-fifo"
@@ -29,6 +36,30 @@ static struct kfifo test;
 static DECLARE_KFIFO(test, unsigned char, FIFO_SIZE);
 #endif
 
+/* size of the dynamic fifos in bytes, kfifo_alloc rounds it up to a power of 2 */
+static unsigned int fifo_size = FIFO_SIZE;
+module_param(fifo_size, uint, 0444);
+
+/* what the proc entry carries, one of FIFO_TYPE_* in kfifo_demo.h */
+static int fifo_type = FIFO_TYPE_BYTE;
+module_param(fifo_type, int, 0444);
+
+/* fifo of struct fifo_elem, kfifo_to_user/kfifo_from_user only move whole elements */
+static DECLARE_KFIFO_PTR(elem_fifo, struct fifo_elem);
+
+/* record fifos, every record is prefixed by a 1 or 2 byte length inside the fifo */
+static struct kfifo_rec_ptr_1 rec1_fifo;
+static struct kfifo_rec_ptr_2 rec2_fifo;
+
+/*
+ * the kfifo_* macros take the record header size from the fifo type at compile
+ * time, the record paths below are shared by both record fifos and call the
+ * exported __kfifo_*_r helpers with the header size of the selected one
+ */
+static struct __kfifo *rec_fifo;
+static size_t rec_hdr;
+static unsigned int rec_max;
+
 int test_func(void)
 {
 	char i;
@@ -73,57 +104,461 @@ int test_func(void)
 	return 0;
 }
 
-static ssize_t fifo_read(struct file *file, char __user *buf,
-			size_t count, loff_t *ppos)
+/*
+ * kfifo needs no locking with only one concurrent reader and one concurrent
+ * writer, so lockless=1 drops read_lock/write_lock. The first file that reads
+ * (writes) owns that side until it is closed, others get -EBUSY.
+ */
+static bool lockless;
+module_param(lockless, bool, 0444);
+
+static struct file *reader;
+static struct file *writer;
+
+static bool fifo_claim(struct file **owner, struct file *file)
+{
+	struct file *cur = READ_ONCE(*owner);
+
+	if (likely(cur == file))
+		return true;
+
+	return !cur && !cmpxchg(owner, NULL, file);
+}
+
+static int fifo_release(struct inode *inode, struct file *file)
+{
+	cmpxchg(&reader, file, NULL);
+	cmpxchg(&writer, file, NULL);
+	return 0;
+}
+
+/*
+ * use_dma=1 moves large reads and writes of the byte fifo with a DMA_MEMCPY
+ * channel (dmatest works with the same engines) instead of the CPU. The fifo
+ * side scatterlist comes from kfifo_dma_in_prepare/kfifo_dma_out_prepare, the
+ * user buffer is pinned and mapped page by page. Without a channel, or when
+ * anything in the DMA path fails, the data is copied by kfifo_to_user and
+ * kfifo_from_user as before. Only the dynamic fifo can be mapped, the static
+ * one lives in module memory.
+ */
+static bool use_dma;
+module_param(use_dma, bool, 0444);
+
+/* transfers smaller than dma_min bytes are cheaper to copy with the CPU */
+static unsigned int dma_min = 4096;
+module_param(dma_min, uint, 0444);
+
+/* at most this many user pages are pinned for one transfer */
+#define DMA_MAX_PAGES 256
+
+static struct dma_chan *dma_chan;
+static atomic_long_t dma_bytes, cpu_bytes, dma_fallbacks;
+
+static void fifo_dma_done(void *arg)
+{
+	complete(arg);
+}
+
+/*
+ * copy len bytes between two mapped scatterlists, one descriptor for every
+ * piece where the segments of both lists overlap. The channel completes
+ * descriptors in order, so only the last one raises an interrupt.
+ */
+static int fifo_dma_copy(struct scatterlist *dst, struct scatterlist *src, unsigned int len)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct dma_async_tx_descriptor *tx;
+	unsigned int doff = 0, soff = 0, n;
+	unsigned long flags;
+
+	while (len) {
+		n = min3(len, sg_dma_len(dst) - doff, sg_dma_len(src) - soff);
+		len -= n;
+		flags = len ? DMA_CTRL_ACK : DMA_CTRL_ACK | DMA_PREP_INTERRUPT;
+
+		tx = dmaengine_prep_dma_memcpy(dma_chan, sg_dma_address(dst) + doff,
+					       sg_dma_address(src) + soff, n, flags);
+		if (!tx)
+			goto fail;
+		if (!len) {
+			tx->callback = fifo_dma_done;
+			tx->callback_param = &done;
+		}
+		if (dma_submit_error(dmaengine_submit(tx)))
+			goto fail;
+
+		doff += n;
+		soff += n;
+		if (doff == sg_dma_len(dst) && len) {
+			dst = sg_next(dst);
+			doff = 0;
+		}
+		if (soff == sg_dma_len(src) && len) {
+			src = sg_next(src);
+			soff = 0;
+		}
+	}
+
+	dma_async_issue_pending(dma_chan);
+	if (wait_for_completion_timeout(&done, msecs_to_jiffies(1000)))
+		return 0;
+
+fail:
+	/* nothing may touch the buffers after they are unmapped */
+	dmaengine_terminate_sync(dma_chan);
+	return -EIO;
+}
+
+/*
+ * move up to count bytes between the byte fifo and the user buffer with the
+ * DMA channel, returns the bytes moved or an error, the fifo is unchanged on
+ * error so the caller can still copy with the CPU
+ */
+static ssize_t fifo_dma_xfer(char __user *buf, size_t count, bool to_user)
+{
+	struct device *dev = dma_chan->device->dev;
+	enum dma_data_direction udir = to_user ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+	enum dma_data_direction fdir = to_user ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+	unsigned long start = (unsigned long)buf;
+	unsigned int off = offset_in_page(start), len, fifo_n;
+	struct scatterlist fifo_sg[2];
+	struct sg_table sgt;
+	struct page **pages;
+	int nr, pinned, ret, i;
+
+	/* kfifo_dma_*_prepare clamp the length but do not return it */
+	len = to_user ? kfifo_len(&test) : kfifo_avail(&test);
+	len = min_t(size_t, len, count);
+	len = min_t(unsigned int, len, DMA_MAX_PAGES * PAGE_SIZE - off);
+	if (!len)
+		return 0;
+
+	/* sg_set_page keeps the chain/end bits, start from a clean table */
+	sg_init_table(fifo_sg, ARRAY_SIZE(fifo_sg));
+	if (to_user)
+		fifo_n = kfifo_dma_out_prepare(&test, fifo_sg, ARRAY_SIZE(fifo_sg), len);
+	else
+		fifo_n = kfifo_dma_in_prepare(&test, fifo_sg, ARRAY_SIZE(fifo_sg), len);
+	if (!fifo_n)
+		return -EIO;
+
+	nr = DIV_ROUND_UP(off + len, PAGE_SIZE);
+	pages = kmalloc_array(nr, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	pinned = get_user_pages_fast(start, nr, to_user ? FOLL_WRITE : 0, pages);
+	if (pinned < nr) {
+		ret = -EFAULT;
+		goto out_put;
+	}
+
+	ret = sg_alloc_table_from_pages(&sgt, pages, nr, off, len, GFP_KERNEL);
+	if (ret)
+		goto out_put;
+
+	ret = -EIO;
+	if (!dma_map_sg(dev, sgt.sgl, sgt.orig_nents, udir))
+		goto out_free;
+	if (!dma_map_sg(dev, fifo_sg, fifo_n, fdir))
+		goto out_unmap;
+
+	if (to_user)
+		ret = fifo_dma_copy(sgt.sgl, fifo_sg, len);
+	else
+		ret = fifo_dma_copy(fifo_sg, sgt.sgl, len);
+
+	dma_unmap_sg(dev, fifo_sg, fifo_n, fdir);
+out_unmap:
+	dma_unmap_sg(dev, sgt.sgl, sgt.orig_nents, udir);
+out_free:
+	sg_free_table(&sgt);
+out_put:
+	for (i = 0; i < pinned; i++) {
+		if (to_user && !ret)
+			set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+	kfree(pages);
+
+	if (ret)
+		return ret;
+
+	if (to_user)
+		kfifo_dma_out_finish(&test, len);
+	else
+		kfifo_dma_in_finish(&test, len);
+	return len;
+}
+
+/* the byte fifo path, with DMA for large transfers when a channel is available */
+static ssize_t byte_xfer(char __user *buf, size_t count, bool to_user)
+{
+	unsigned int copied;
+	ssize_t ret;
+
+	if (dma_chan && count >= dma_min) {
+		ret = fifo_dma_xfer(buf, count, to_user);
+		if (ret >= 0) {
+			atomic_long_add(ret, &dma_bytes);
+			return ret;
+		}
+		atomic_long_inc(&dma_fallbacks);
+	}
+
+	if (to_user)
+		ret = kfifo_to_user(&test, buf, count, &copied);
+	else
+		ret = kfifo_from_user(&test, (const char __user *)buf, count, &copied);
+	if (ret)
+		return ret;
+
+	atomic_long_add(copied, &cpu_bytes);
+	return copied;
+}
+
+static inline bool rec_is_empty(void)
+{
+	return rec_fifo->in == rec_fifo->out;
+}
+
+/*
+ * copy as many whole records as fit into buf, each one as a __u16 length
+ * followed by the data; -EMSGSIZE if even the first record does not fit
+ */
+static ssize_t rec_read(char __user *buf, size_t count)
 {
+	unsigned int len, copied;
+	size_t off = 0;
 	int ret;
+
+	while (!rec_is_empty()) {
+		len = __kfifo_len_r(rec_fifo, rec_hdr);
+		if (off + FIFO_REC_HDR + len > count)
+			break;
+
+		if (put_user((__u16)len, (__u16 __user *)(buf + off)))
+			return off ? off : -EFAULT;
+		ret = __kfifo_to_user_r(rec_fifo, buf + off + FIFO_REC_HDR, len, &copied, rec_hdr);
+		if (ret)
+			return off ? off : ret;
+
+		off += FIFO_REC_HDR + len;
+	}
+
+	if (!off && !rec_is_empty())
+		return -EMSGSIZE;
+	return off;
+}
+
+/* one write is one record, it goes in whole or not at all */
+static ssize_t rec_write(const char __user *buf, size_t count)
+{
 	unsigned int copied;
+	int ret;
+
+	if (!count)
+		return 0;
+	if (count > rec_max || count + rec_hdr > rec_fifo->mask + 1)
+		return -EMSGSIZE;
+
+	ret = __kfifo_from_user_r(rec_fifo, buf, count, &copied, rec_hdr);
+	return ret ? ret : copied;
+}
+
+static ssize_t fifo_do_read(char __user *buf, size_t count)
+{
+	unsigned int copied;
+	int ret;
+
+	switch (fifo_type) {
+	case FIFO_TYPE_ELEM:
+		if (count < sizeof(struct fifo_elem))
+			return -EINVAL;
+		ret = kfifo_to_user(&elem_fifo, buf, count, &copied);
+		break;
+	case FIFO_TYPE_REC1:
+	case FIFO_TYPE_REC2:
+		return rec_read(buf, count);
+	default:
+		return byte_xfer(buf, count, true);
+	}
+
+	return ret ? ret : copied;
+}
+
+static ssize_t fifo_do_write(const char __user *buf, size_t count)
+{
+	unsigned int copied;
+	int ret;
+
+	switch (fifo_type) {
+	case FIFO_TYPE_ELEM:
+		/* a trailing partial element is not written */
+		if (count < sizeof(struct fifo_elem))
+			return -EINVAL;
+		ret = kfifo_from_user(&elem_fifo, buf, count, &copied);
+		break;
+	case FIFO_TYPE_REC1:
+	case FIFO_TYPE_REC2:
+		return rec_write(buf, count);
+	default:
+		return byte_xfer((char __user *)buf, count, false);
+	}
+
+	return ret ? ret : copied;
+}
+
+static ssize_t fifo_read(struct file *file, char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	if (lockless) {
+		if (!fifo_claim(&reader, file))
+			return -EBUSY;
+		return fifo_do_read(buf, count);
+	}
+
 	if (mutex_lock_interruptible(&read_lock)) {
 		return -ERESTARTSYS;
 	}
-	ret = kfifo_to_user(&test, buf, count, &copied);
+	ret = fifo_do_read(buf, count);
 	mutex_unlock(&read_lock);
-	return ret ? ret : copied;
+	return ret;
 }
 
 static ssize_t fifo_write(struct file *file, const char __user *buf,
 			size_t count, loff_t *ppos)
 {
-	int ret;
-	unsigned int copied;
+	ssize_t ret;
+
+	if (lockless) {
+		if (!fifo_claim(&writer, file))
+			return -EBUSY;
+		return fifo_do_write(buf, count);
+	}
 
 	if (mutex_lock_interruptible(&write_lock)) {
 		return -ERESTARTSYS;
 	}
-	ret = kfifo_from_user(&test, buf, count, &copied);
+	ret = fifo_do_write(buf, count);
 	mutex_unlock(&write_lock);
-	return ret ? ret : copied;
+	return ret;
 }
 
 static const struct file_operations fifo_fops = {
 	.owner = THIS_MODULE,
 	.read = fifo_read,
 	.write = fifo_write,
+	.release = fifo_release,
 	.llseek = noop_llseek,
 };
 
+static void fifo_dma_init(void)
+{
+	dma_cap_mask_t mask;
+
+	dma_cap_zero(mask);
+	dma_cap_set(DMA_MEMCPY, mask);
+	dma_chan = dma_request_channel(mask, NULL, NULL);
+	if (!dma_chan) {
+		printk(KERN_INFO "no DMA_MEMCPY channel, copying with the CPU\n");
+		return;
+	}
+	printk(KERN_INFO "fifo DMA with %s, dma_min %u\n", dma_chan_name(dma_chan), dma_min);
+}
+
+static void fifo_dma_exit(void)
+{
+	if (!dma_chan)
+		return;
+
+	dma_release_channel(dma_chan);
+	dma_chan = NULL;
+	printk(KERN_INFO "fifo DMA %ld byte(s), CPU %ld byte(s), %ld fallback(s)\n",
+	       atomic_long_read(&dma_bytes), atomic_long_read(&cpu_bytes),
+	       atomic_long_read(&dma_fallbacks));
+}
+
+/* allocate the element or record fifo selected by fifo_type */
+static int typed_fifo_alloc(void)
+{
+	switch (fifo_type) {
+	case FIFO_TYPE_ELEM:
+		/* kfifo_alloc counts elements, not bytes */
+		return kfifo_alloc(&elem_fifo, max_t(unsigned int, fifo_size / sizeof(struct fifo_elem), 2),
+				   GFP_KERNEL);
+	case FIFO_TYPE_REC1:
+		rec_fifo = &rec1_fifo.kfifo;
+		rec_hdr = 1;
+		rec_max = 255;
+		return kfifo_alloc(&rec1_fifo, fifo_size, GFP_KERNEL);
+	case FIFO_TYPE_REC2:
+		rec_fifo = &rec2_fifo.kfifo;
+		rec_hdr = 2;
+		rec_max = 65535;
+		return kfifo_alloc(&rec2_fifo, fifo_size, GFP_KERNEL);
+	}
+
+	return 0;
+}
+
+static void typed_fifo_free(void)
+{
+	switch (fifo_type) {
+	case FIFO_TYPE_ELEM:
+		kfifo_free(&elem_fifo);
+		break;
+	case FIFO_TYPE_REC1:
+		kfifo_free(&rec1_fifo);
+		break;
+	case FIFO_TYPE_REC2:
+		kfifo_free(&rec2_fifo);
+		break;
+	}
+}
+
 static int __init mod_init(void)
 {
-#ifdef DYNAMIC
         int ret;
 
-        ret = kfifo_alloc(&test, FIFO_SIZE, GFP_KERNEL);
+	BUILD_BUG_ON(sizeof(struct fifo_elem) != 64);
+	if (fifo_type < FIFO_TYPE_BYTE || fifo_type > FIFO_TYPE_REC2) {
+		printk(KERN_INFO "bad fifo_type %d\n", fifo_type);
+		return -EINVAL;
+	}
+
+#ifdef DYNAMIC
+        ret = kfifo_alloc(&test, fifo_size, GFP_KERNEL);
         if (ret < 0) {
                 printk(KERN_INFO "error kfifo_alloc\n");
                 return ret;
         }
+
+	if (use_dma && fifo_type == FIFO_TYPE_BYTE)
+		fifo_dma_init();
 #else
 	INIT_KFIFO(test);
 #endif
-	if (test_func() < 0)
+	/* the self test fills the fifo and prints every element, skip it for big fifos */
+	if (kfifo_size(&test) <= FIFO_SIZE && test_func() < 0)
 		return -EIO;
+
+	ret = typed_fifo_alloc();
+	if (ret < 0) {
+		printk(KERN_INFO "error kfifo_alloc for fifo_type %d\n", fifo_type);
+#ifdef DYNAMIC
+		fifo_dma_exit();
+                kfifo_free(&test);
+#endif
+		return ret;
+	}
+
 	if (proc_create(PROC_FIFO, 0, NULL, &fifo_fops) == NULL) {
+		typed_fifo_free();
 #ifdef DYNAMIC
+		fifo_dma_exit();
                 kfifo_free(&test);
 #endif
 		return -ENOMEM;
@@ -133,7 +568,9 @@ static int __init mod_init(void)
 static void __exit mod_exit(void)
 {
 	remove_proc_entry(PROC_FIFO, NULL);
+	typed_fifo_free();
 #ifdef DYNAMIC
+	fifo_dma_exit();
         kfifo_free(&test);
 #endif
 	return;
@@ -0,0 +1,146 @@
+/*
+ * structured telemetry through /proc/bytestream-fifo
+ *
+ *	insmod kfifo_demo_static.ko fifo_size=65536 fifo_type=1	fixed 64 byte elements
+ *	insmod kfifo_demo_static.ko fifo_size=65536 fifo_type=3	variable length records
+ *	./kfifo_telemetry -p [-n count] [-r]		producer, -r writes records of varying length
+ *	./kfifo_telemetry -c [-n count] [-r]		consumer, reads in batches and checks the sequence
+ *
+ * fifo_type=2 limits records to 255 bytes, the producer keeps them below 200 bytes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+
+#include "kfifo_demo.h"
+
+#define PROC_FIFO "/proc/bytestream-fifo"
+#define BATCH 256		/* elements per read */
+
+static long count = 1000000;
+static int records;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the fifo returns 0 when it is full or empty, just retry */
+static void produce(int fd)
+{
+	struct fifo_elem e;
+	char rec[256];
+	long seq;
+	int len;
+
+	memset(&e, 0, sizeof(e));
+	for (seq = 0; seq < count; seq++) {
+		if (records) {
+			/* "seq N " followed by up to 127 filler bytes */
+			len = snprintf(rec, sizeof(rec), "seq %ld ", seq);
+			memset(rec + len, 'a' + seq % 26, seq % 128);
+			len += seq % 128;
+			while (write(fd, rec, len) == 0)
+				sched_yield();
+		} else {
+			e.ts = (__u64)(now() * 1e9);
+			e.seq = seq;
+			while (write(fd, &e, sizeof(e)) == 0)
+				sched_yield();
+		}
+	}
+}
+
+/* elements come back without any framing, records with a __u16 length in front */
+static void consume(int fd)
+{
+	char buf[BATCH * sizeof(struct fifo_elem)];
+	struct fifo_elem *e = (struct fifo_elem *)buf;
+	unsigned long calls = 0;
+	long seq = 0;
+	ssize_t ret, off;
+	__u16 len;
+	int i;
+
+	while (seq < count) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret < 0) {
+			perror("read");
+			return;
+		}
+		if (!ret) {
+			sched_yield();
+			continue;
+		}
+		calls++;
+
+		if (!records) {
+			for (i = 0; i < ret / (ssize_t)sizeof(*e); i++, seq++)
+				if (e[i].seq != (__u32)seq)
+					printf("expect element %ld, got %u\n", seq, e[i].seq);
+			continue;
+		}
+
+		for (off = 0; off < ret; off += FIFO_REC_HDR + len, seq++) {
+			memcpy(&len, buf + off, sizeof(len));
+			if (atol(buf + off + FIFO_REC_HDR + 4) != seq || len != snprintf(NULL, 0, "seq %ld ", seq) + seq % 128)
+				printf("bad record %ld, len %u\n", seq, len);
+		}
+	}
+
+	printf("consumed %ld %s(s) in %lu read(s)\n", seq, records ? "record" : "element", calls);
+}
+
+int main(int argc, char *argv[])
+{
+	int producer = -1, opt, fd;
+	double begin;
+
+	while ((opt = getopt(argc, argv, "pcn:r")) != -1) {
+		switch (opt) {
+		case 'p':
+			producer = 1;
+			break;
+		case 'c':
+			producer = 0;
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'r':
+			records = 1;
+			break;
+		default:
+			producer = -1;
+			break;
+		}
+	}
+
+	if (producer < 0 || count <= 0) {
+		printf("usage: %s -p|-c [-n count] [-r]\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(PROC_FIFO, producer ? O_WRONLY : O_RDONLY);
+	if (fd == -1) {
+		printf("fail to open %s\n", PROC_FIFO);
+		return 1;
+	}
+
+	begin = now();
+	if (producer)
+		produce(fd);
+	else
+		consume(fd);
+	printf("%.0f %s(s)/s\n", count / (now() - begin), records ? "record" : "element");
+
+	close(fd);
+	return 0;
+}
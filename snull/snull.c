@@ -19,154 +19,393 @@
 #include <linux/ip.h>
 #include <linux/etherdevice.h>
 #include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/llist.h>
+#include <linux/ethtool.h>
+#include <net/ip.h>
+#include <net/checksum.h>
+#include <net/xdp.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
+#include <linux/ptr_ring.h>
 
 #define SNULL_RX_INTR 0x0001
 #define SNULL_TX_INTR 0x0002
 
-int pool_size = 8;
+#define SNULL_MAX_QUEUES 64
+#define SNULL_MAX_POOL 4096
+
+#define SNULL_XDP_TX		0x0001	/* 这次轮询有XDP_TX的帧，结束时通知对端 */
+#define SNULL_XDP_REDIR		0x0002	/* 这次轮询有XDP_REDIRECT，结束时xdp_do_flush_map */
+#define SNULL_XDP_RING		256
+/* XDP只处理拷贝路径一帧以内的包，挂了程序之后对端的MTU不能超过它 */
+#define SNULL_XDP_MAX_MTU	ETH_DATA_LEN
+
+/* 每个队列包池的大小，加载之后可以用ethtool -G sn0 tx N修改 */
+int pool_size = 256;
 module_param(pool_size, int, 0);
 
+/*
+ * use_napi=1：接收中断只关掉接收中断并调度NAPI，由snull_poll在软中断中
+ * 每次最多取budget个包，通过napi_gro_receive上报，不再在发送进程中逐个netif_rx
+ */
+static int use_napi = 0;
+module_param(use_napi, int, 0);
+
+/*
+ * zerocopy=1：发送的skb不再拷贝到snull_packet，原地改写IP地址之后直接交给对端网卡
+ * snull_packet池只在skb不能改写时使用
+ */
+static int zerocopy = 0;
+module_param(zerocopy, int, 0);
+
+/*
+ * num_queues：每个网卡的发送/接收队列数，每个队列有自己的包池、接收队列、锁和NAPI
+ * 本端发送队列i上的包总是交给对端的接收队列i，协议栈按流的hash(或者XPS)选发送队列，
+ * 同一个流在两端都固定在同一对队列上，不同的流可以在不同的CPU上并行收发
+ */
+static int num_queues = 1;
+module_param(num_queues, int, 0);
+
 void snull_module_exit(void);
 static void (*snull_interrupt)(int, void *, struct pt_regs *);
 
 struct net_device *snull_devs[2];
 struct snull_packet {
 	struct snull_packet *next;
-	struct net_device *dev;
+	struct llist_node free;		/* 在包池中时挂在q->ppool上 */
+	struct snull_queue *queue;	/* 包属于哪个队列的包池 */
 	int	datalen;
-	u8 data[ETH_DATA_LEN];
+	u8 data[ETH_FRAME_LEN];		/* 放得下一个不超过1500字节MTU的完整以太网帧 */
 };
 
-struct snull_priv {
+/*
+ * 一对发送/接收队列，原来整个网卡共用的状态都搬到了这里
+ * 发送状态由协议栈的发送队列锁保护，接收队列由lock保护
+ * 包池是无锁的llist：只有持有发送队列锁的发送函数取包，归还可以在任何上下文
+ */
+struct snull_queue {
 	struct net_device *dev;
+	u16 index;
 	struct sk_buff *skb;
-	struct snull_packet *ppool;
+	struct llist_head ppool;
+	int pool_count;			/* 包池应有的包数，修改时持有rtnl锁 */
+	atomic_t pool_excess;		/* 包池缩小时还在对端接收队列中的包，回来时直接释放 */
 	struct snull_packet *rx_queue;
+	struct snull_packet *rx_tail;	/* 接收队列的队尾，先进先出，NAPI一次取多个包时不乱序 */
+	struct sk_buff_head rx_skbs;	/* zerocopy和NAPI同时打开时，对端直接交过来的skb */
 	spinlock_t lock;
 	int status;
 	int rx_int_enabled;
 	int tx_packetlen;
 	u8 *tx_packetdata;
-	struct net_device_stats stats;
+	unsigned long rx_packets;
+	unsigned long rx_bytes;
+	unsigned long rx_dropped;
+	unsigned long tx_packets;
+	unsigned long tx_bytes;
+	unsigned long tx_dropped;
 	struct napi_struct napi;
+	struct ptr_ring xdp_ring;	/* 对端发过来的xdp_frame，只有这个队列的NAPI取 */
+	struct xdp_rxq_info xdp_rxq;
+	struct xdp_mem_info xdp_mem;	/* xdp_rxq中原来的内存类型，运行对端的帧时临时换掉 */
+	int xdp_ready;			/* xdp_ring初始化完成，对端可以往里放帧 */
+} ____cacheline_aligned_in_smp;
+
+struct snull_priv {
+	struct net_device *dev;
+	struct bpf_prog __rcu *xdp_prog;
+	int num_queues;
+	struct snull_queue queues[];
 };
 
-struct snull_packet *snull_get_tx_buffer(struct net_device *dev)
+static struct snull_queue *snull_get_queue(struct net_device *dev, u16 index)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	unsigned long flags;
-	struct snull_packet *pkt;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	/* 让pkt指向下一个pkt,如果数据包被取完了，通知内核，要求停止发送 */
-	pkt = priv->ppool;
-	priv->ppool = pkt->next;
+	return &priv->queues[index];
+}
 
-	if (priv->ppool == NULL) {
-		printk (KERN_INFO "Pool empty\n");
-		netif_stop_queue(dev);
-	}
+/*
+ * 包池空了就停掉发送队列，停掉之后再检查一次：
+ * snull_release_buffer先放回包再检查队列是否停止，两边总有一个能看到对方
+ */
+static void snull_maybe_stop(struct snull_queue *q)
+{
+	if (!llist_empty(&q->ppool))
+		return;
 
-	spin_unlock_irqrestore(&priv->lock, flags);
-	return pkt;
+	printk (KERN_INFO "Pool empty\n");
+	netif_stop_subqueue(q->dev, q->index);
+	smp_mb__after_atomic();
+	if (!llist_empty(&q->ppool))
+		netif_wake_subqueue(q->dev, q->index);
+}
+
+/* 只在持有发送队列锁时调用，llist_del_first只允许一个消费者 */
+struct snull_packet *snull_get_tx_buffer(struct snull_queue *q)
+{
+	struct llist_node *node;
+
+	node = llist_del_first(&q->ppool);
+	snull_maybe_stop(q);
+	return node ? llist_entry(node, struct snull_packet, free) : NULL;
 }
 
 void snull_release_buffer(struct snull_packet *pkt)
 {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(pkt->dev);
-	
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->ppool;
-	priv->ppool = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	struct snull_queue *q = pkt->queue;
+
+	if (atomic_add_unless(&q->pool_excess, -1, 0)) {
+		kfree(pkt);
+		return;
+	}
 
-	if (netif_queue_stopped(pkt->dev) && pkt->next == NULL)
-		netif_wake_queue(pkt->dev);
+	/* llist_add返回true说明包池原来是空的，发送队列可能已经停了 */
+	if (llist_add(&pkt->free, &q->ppool) && __netif_subqueue_stopped(q->dev, q->index))
+		netif_wake_subqueue(q->dev, q->index);
 }
 
-void snull_setup_pool(struct net_device *dev)
+/* 分配n个包放进包池，返回实际分配的个数 */
+static int snull_fill_pool(struct snull_queue *q, int n)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	int i;
 	struct snull_packet *pkt;
+	int i;
 
-	priv->ppool = NULL;
-	for (i = 0; i < pool_size; i++) {
+	for (i = 0; i < n; i++) {
 		pkt = kmalloc (sizeof (struct snull_packet), GFP_KERNEL);
 		if (pkt == NULL) {
 			printk (KERN_NOTICE "Ran out of memory allocating packet pool\n");
-			return;
+			break;
 		}
-		pkt->dev = dev;
-		pkt->next = priv->ppool;
-		priv->ppool = pkt;
-		printk(KERN_INFO "%d name:%s, pkt:0x%lx, priv:0x%lx,priv->ppool:0x%lx\n",
-				i, dev->name, (unsigned long)pkt, (unsigned long)priv, (unsigned long)priv->ppool);
+		pkt->queue = q;
+		llist_add(&pkt->free, &q->ppool);
 	}
-	printk(KERN_INFO "create snull pool\n");
+	q->pool_count += i;
+	return i;
 }
 
-void snull_teardown_pool(struct net_device *dev)
+void snull_setup_pool(struct snull_queue *q)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
+	init_llist_head(&q->ppool);
+	q->pool_count = 0;
+	atomic_set(&q->pool_excess, 0);
+	snull_fill_pool(q, pool_size);
+	printk(KERN_INFO "create snull pool: name:%s queue:%u, %d packet(s)\n",
+			q->dev->name, q->index, q->pool_count);
+}
+
+void snull_teardown_pool(struct snull_queue *q)
+{
+	struct snull_packet *pkt, *next;
+
+	llist_for_each_entry_safe(pkt, next, llist_del_all(&q->ppool), free)
+		kfree (pkt);
+}
+
+/*
+ * 运行时修改包池大小，调用时持有rtnl锁
+ * 变大直接分配新包；变小先释放包池里空闲的包，不够的部分记在pool_excess中，
+ * 等对端收完之后在snull_release_buffer中释放
+ */
+static int snull_resize_pool(struct snull_queue *q, int size)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+	struct llist_node *node;
+	int n;
+
+	if (size >= q->pool_count) {
+		n = size - q->pool_count;
+		/* 还没释放的多余包留下来就行，不用重新分配 */
+		while (n && atomic_add_unless(&q->pool_excess, -1, 0)) {
+			q->pool_count++;
+			n--;
+		}
+		n -= snull_fill_pool(q, n);
+		if (__netif_subqueue_stopped(q->dev, q->index) && !llist_empty(&q->ppool))
+			netif_wake_subqueue(q->dev, q->index);
+		return n ? -ENOMEM : 0;
+	}
 
-	while ((pkt = priv->ppool)) {
-	priv->ppool = pkt->next;
-	printk(KERN_INFO "name:%s, pkt:0x%lx, priv:0x%lx,priv->ppool:0x%lx\n",
-				dev->name, (unsigned long)pkt, (unsigned long)priv, (unsigned long)priv->ppool);
-	kfree (pkt);
+	/* 持有发送队列锁，这时只有这里从包池取包 */
+	n = q->pool_count - size;
+	__netif_tx_lock_bh(txq);
+	while (n && (node = llist_del_first(&q->ppool))) {
+		kfree(llist_entry(node, struct snull_packet, free));
+		q->pool_count--;
+		n--;
 	}
+	atomic_add(n, &q->pool_excess);
+	q->pool_count -= n;
+	snull_maybe_stop(q);
+	__netif_tx_unlock_bh(txq);
+
+	return 0;
 }
 
-void snull_enqueue_buf(struct net_device *dev, struct snull_packet *pkt)
+void snull_enqueue_buf(struct snull_queue *q, struct snull_packet *pkt)
 {
 	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(dev);
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->rx_queue;
-	priv->rx_queue = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	spin_lock_irqsave(&q->lock, flags);
+	pkt->next = NULL;
+	if (q->rx_tail)
+		q->rx_tail->next = pkt;
+	else
+		q->rx_queue = pkt;
+	q->rx_tail = pkt;
+	spin_unlock_irqrestore(&q->lock, flags);
 }
 
-struct snull_packet *snull_dequeue_buf(struct net_device *dev)
+struct snull_packet *snull_dequeue_buf(struct snull_queue *q)
 {
-	struct snull_priv *priv = netdev_priv(dev);
 	struct snull_packet *pkt;
 	unsigned long flags;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->rx_queue;
-	if (pkt != NULL)
-		priv->rx_queue = pkt->next;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	spin_lock_irqsave(&q->lock, flags);
+	pkt = q->rx_queue;
+	if (pkt != NULL) {
+		q->rx_queue = pkt->next;
+		if (q->rx_queue == NULL)
+			q->rx_tail = NULL;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
 	return pkt;
 }
 
-static void snull_rx_ints(struct net_device *dev, int enable)
+/* rx_skbs也用q->lock保护，和rx_queue一起决定是否重新打开接收中断 */
+void snull_enqueue_skb(struct snull_queue *q, struct sk_buff *skb)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	priv->rx_int_enabled = enable;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	__skb_queue_tail(&q->rx_skbs, skb);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+struct sk_buff *snull_dequeue_skb(struct snull_queue *q)
+{
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	skb = __skb_dequeue(&q->rx_skbs);
+	spin_unlock_irqrestore(&q->lock, flags);
+	return skb;
+}
+
+static void snull_rx_ints(struct snull_queue *q, int enable)
+{
+	q->rx_int_enabled = enable;
+}
+
+/*
+ * 本端的发送队列置发送中断，对端同一序号的发送队列置接收中断，两者可能同时进行，
+ * status在队列锁中修改，不会丢掉另一边的中断
+ */
+static void snull_set_status(struct snull_queue *q, int bits)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->status |= bits;
+	spin_unlock_irqrestore(&q->lock, flags);
 }
 
 int snull_open(struct net_device *dev)
 {
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	int i, ret;
+
 	if (dev == snull_devs[0])
 		memcpy(dev->dev_addr, "\0SNUL0", ETH_ALEN);
 	else
 		memcpy(dev->dev_addr, "\0SNUL1", ETH_ALEN);
 
-	netif_start_queue(dev);
+	for (i = 0; use_napi && i < priv->num_queues; i++) {
+		q = &priv->queues[i];
+		ret = ptr_ring_init(&q->xdp_ring, SNULL_XDP_RING, GFP_KERNEL);
+		if (ret)
+			goto err;
+		/* XDP的缓冲区都是单个页面 */
+		ret = xdp_rxq_info_reg(&q->xdp_rxq, dev, i);
+		if (ret)
+			goto err_ring;
+		ret = xdp_rxq_info_reg_mem_model(&q->xdp_rxq, MEM_TYPE_PAGE_ORDER0, NULL);
+		if (ret) {
+			xdp_rxq_info_unreg(&q->xdp_rxq);
+			goto err_ring;
+		}
+		q->xdp_mem = q->xdp_rxq.mem;
+		napi_enable(&q->napi);
+	}
+
+	/*
+	 * __dev_open在调用ndo_open之前就设置了__LINK_STATE_START，netif_running挡不住对端，
+	 * 所有队列的xdp_ring都初始化好之后再发布出去，出错时对端从来没有看到过
+	 */
+	for (i = 0; use_napi && i < priv->num_queues; i++)
+		smp_store_release(&priv->queues[i].xdp_ready, 1);
+	netif_tx_start_all_queues(dev);
 	printk(KERN_INFO "snull open\n");
 
 	return 0;
+
+err_ring:
+	ptr_ring_cleanup(&priv->queues[i].xdp_ring, NULL);
+err:
+	while (--i >= 0) {
+		q = &priv->queues[i];
+		napi_disable(&q->napi);
+		xdp_rxq_info_unreg(&q->xdp_rxq);
+		ptr_ring_cleanup(&q->xdp_ring, NULL);
+	}
+	return ret;
+}
+
+/* 关闭网卡时xdp_ring中剩下的帧 */
+static void snull_xdp_ring_free(void *ptr)
+{
+	xdp_return_frame(ptr);
 }
 
 int snull_release(struct net_device *dev)
 {
-	netif_stop_queue(dev);
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	struct sk_buff_head list;
+	unsigned long flags;
+	int i;
+
+	netif_tx_stop_all_queues(dev);
+	for (i = 0; use_napi && i < priv->num_queues; i++) {
+		WRITE_ONCE(priv->queues[i].xdp_ready, 0);
+		napi_disable(&priv->queues[i].napi);
+	}
+	/*
+	 * 卸载模块时dev->dismantle已经设置，dev_deactivate_many不会synchronize_net，
+	 * 这里自己等看到过xdp_ready的对端放完帧，之后才能释放xdp_ring
+	 */
+	if (use_napi)
+		synchronize_net();
+
+	for (i = 0; i < priv->num_queues; i++) {
+		q = &priv->queues[i];
+		if (use_napi) {
+			/* 剩下的帧在这里释放 */
+			ptr_ring_cleanup(&q->xdp_ring, snull_xdp_ring_free);
+			xdp_rxq_info_unreg(&q->xdp_rxq);
+		}
+
+		/* 还没有上报的skb直接丢掉，不在关中断的时候释放 */
+		__skb_queue_head_init(&list);
+		spin_lock_irqsave(&q->lock, flags);
+		skb_queue_splice_init(&q->rx_skbs, &list);
+		spin_unlock_irqrestore(&q->lock, flags);
+		__skb_queue_purge(&list);
+	}
 	printk(KERN_INFO "snull release\n");
 
 	return 0;
@@ -175,18 +414,17 @@ int snull_release(struct net_device *dev)
 /*
  * 接收数据包：检索，封装并传递到更高层
  */
-void snull_rx(struct net_device *dev, struct snull_packet *pkt)
+void snull_rx(struct snull_queue *q, struct snull_packet *pkt)
 {
 	struct sk_buff *skb;
-	struct snull_priv *priv;
-	priv = netdev_priv(dev);
+	struct net_device *dev = q->dev;
 
 	/* 为接收包分配一个skb,+2是为了下面的skb_reserve使用 */
 	skb = dev_alloc_skb(pkt->datalen + 2);
 	if (!skb) {
 		if (printk_ratelimit())
 			printk(KERN_NOTICE "snull rx: low on mem - packet dropped\n");
-		priv->stats.rx_dropped++;
+		q->rx_dropped++;
 		goto out;
 	}
 
@@ -207,9 +445,11 @@ void snull_rx(struct net_device *dev, struct snull_packet *pkt)
 	skb->protocol = eth_type_trans(skb, dev);
 	printk(KERN_INFO "skb->protocol:%d\n", skb->protocol);
 	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+	/* 记录接收队列，RPS按接收队列的rps_cpus选CPU */
+	skb_record_rx_queue(skb, q->index);
 	/* 统计接收包数和字节数 */
-	priv->stats.rx_packets++;
-	priv->stats.rx_bytes += pkt->datalen;
+	q->rx_packets++;
+	q->rx_bytes += pkt->datalen;
 	/* 上报应用层 */
 	netif_rx(skb);
 out:
@@ -218,25 +458,26 @@ out:
 
 /*
  * 数据的收发都要依靠中断,在中断中要处理rx tx中断
+ * 每个队列有自己的中断，dev_id是队列
  */
 static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 {
 	int statusword;
-	struct snull_priv *priv;
+	struct net_device *dev;
 	struct snull_packet *pkt = NULL;
 
-	struct net_device *dev = (struct net_device *)dev_id;
+	struct snull_queue *q = (struct snull_queue *)dev_id;
 
 	/* paranoid */
-	if (!dev)
+	if (!q)
 		return;
 
-	/* Lock the device */
-	priv = netdev_priv(dev);
+	/* Lock the queue */
+	dev = q->dev;
 
-	spin_lock(&priv->lock);
-	statusword = priv->status;
-	priv->status = 0;
+	spin_lock(&q->lock);
+	statusword = q->status;
+	q->status = 0;
 	/*
 	 * 数据包到来，产生接收中断 调用接收函数
 	 * 在接收函数中申请skb，将收到的pkt,拷贝到skb中
@@ -244,12 +485,14 @@ static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	 */
 	if (statusword & SNULL_RX_INTR) {
 		printk(KERN_INFO "---start %s rx process---\n", dev->name);
-		printk(KERN_INFO "name:%s enter the rx interrupt\n", dev->name);
-		pkt = priv->rx_queue;
+		printk(KERN_INFO "name:%s queue:%u enter the rx interrupt\n", dev->name, q->index);
+		pkt = q->rx_queue;
 		if (pkt) {
-			priv->rx_queue = pkt->next;
+			q->rx_queue = pkt->next;
+			if (q->rx_queue == NULL)
+				q->rx_tail = NULL;
 			/* 网卡接收到数据，上报给应用层 */
-			snull_rx(dev, pkt);
+			snull_rx(q, pkt);
 		}
 		printk(KERN_INFO "--- stop %s rx process---\n", dev->name);
 	}
@@ -257,12 +500,12 @@ static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	/* 数据包传输完成，产生传输中断
 	 * 统计发送的包数和字节数，并释放这个包的内存 */
 	if (statusword & SNULL_TX_INTR) {
-		printk(KERN_INFO "name:%s enter the tx interrupt\n", dev->name);
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		dev_kfree_skb(priv->skb);
+		printk(KERN_INFO "name:%s queue:%u enter the tx interrupt\n", dev->name, q->index);
+		q->tx_packets++;
+		q->tx_bytes += q->tx_packetlen;
+		dev_kfree_skb(q->skb);
 	}
-	spin_unlock(&priv->lock);
+	spin_unlock(&q->lock);
 
 	if (pkt)
 		snull_release_buffer(pkt); /* Do this outside the lock! */
@@ -271,11 +514,379 @@ static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	return;
 }
 
-static void snull_hw_tx(char *buf, int len, struct net_device *dev)
+/*
+ * XDP：在接收路径上分配skb之前运行BPF程序
+ * 拷贝路径的包先拷贝到一个页面，前面留出XDP_PACKET_HEADROOM，XDP_PASS之后直接在页面上建skb
+ * XDP_TX和ndo_xdp_xmit发出的xdp_frame放进对端同一序号接收队列的xdp_ring，由对端的NAPI取走
+ */
+static struct net_device *snull_peer(struct net_device *dev)
+{
+	return snull_devs[dev == snull_devs[0] ? 1 : 0];
+}
+
+/*
+ * xdp_ring不在队列锁里入队，在队列锁中检查接收中断，
+ * 和snull_poll打开接收中断之后检查队列互斥，不会漏掉中断
+ */
+static void snull_raise_rx(struct snull_queue *dq)
+{
+	unsigned long flags;
+	int raise;
+
+	spin_lock_irqsave(&dq->lock, flags);
+	raise = dq->rx_int_enabled;
+	if (raise)
+		dq->status |= SNULL_RX_INTR;
+	spin_unlock_irqrestore(&dq->lock, flags);
+
+	if (raise)
+		snull_interrupt(0, dq, NULL);
+}
+
+/* 把xdp_frame从dev的第index个队列发给对端，放不下的帧直接释放，返回发出去的帧数 */
+static int snull_xdp_xmit_frames(struct net_device *dev, u16 index,
+				 struct xdp_frame **frames, int n)
+{
+	struct net_device *dest = snull_peer(dev);
+	struct snull_queue *q = snull_get_queue(dev, index);
+	struct snull_queue *dq = snull_get_queue(dest, index);
+	int i, sent = 0;
+
+	/*
+	 * xdp_ring在snull_open中分配，xdp_ready之前不能碰它
+	 * 这里在软中断中运行，对端清掉xdp_ready之后的synchronize_net会等这里放完
+	 */
+	if (!smp_load_acquire(&dq->xdp_ready)) {
+		for (i = 0; i < n; i++)
+			xdp_return_frame(frames[i]);
+		q->tx_dropped += n;
+		return 0;
+	}
+
+	spin_lock(&dq->xdp_ring.producer_lock);
+	for (i = 0; i < n; i++) {
+		if (frames[i]->len > dest->mtu + ETH_HLEN ||
+		    __ptr_ring_produce(&dq->xdp_ring, frames[i])) {
+			xdp_return_frame(frames[i]);
+			q->tx_dropped++;
+			continue;
+		}
+		q->tx_packets++;
+		q->tx_bytes += frames[i]->len;
+		sent++;
+	}
+	spin_unlock(&dq->xdp_ring.producer_lock);
+
+	return sent;
+}
+
+static void snull_xdp_flush(struct net_device *dev, u16 index)
+{
+	snull_raise_rx(snull_get_queue(snull_peer(dev), index));
+}
+
+/* 别的网卡XDP_REDIRECT到snull时调用，按当前CPU选队列 */
+static int snull_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames, u32 flags)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	u16 index = smp_processor_id() % priv->num_queues;
+	int sent;
+
+	/* 只有NAPI模式才有xdp_ring，和snull_xdp_set一样拒绝 */
+	if (!use_napi)
+		return -EOPNOTSUPP;
+	if (flags & ~XDP_XMIT_FLAGS_MASK)
+		return -EINVAL;
+
+	sent = snull_xdp_xmit_frames(dev, index, frames, n);
+	if (flags & XDP_XMIT_FLUSH)
+		snull_xdp_flush(dev, index);
+
+	return sent;
+}
+
+/*
+ * 运行XDP程序，返回XDP_PASS时由调用者建skb，返回XDP_DROP时由调用者释放缓冲区
+ * XDP_TX和XDP_REDIRECT时缓冲区已经变成xdp_frame交出去了
+ */
+static u32 snull_run_xdp(struct snull_queue *q, struct bpf_prog *prog,
+			 struct xdp_buff *xdp, unsigned int *xdp_flags)
+{
+	struct xdp_frame *frame;
+	u32 act;
+
+	act = bpf_prog_run_xdp(prog, xdp);
+	switch (act) {
+	case XDP_PASS:
+		return XDP_PASS;
+	case XDP_TX:
+		/* 从哪个网卡收到就从哪个网卡发回去，到达发送端同一序号的队列 */
+		frame = convert_to_xdp_frame(xdp);
+		if (!frame)
+			goto err;
+		snull_xdp_xmit_frames(q->dev, q->index, &frame, 1);
+		*xdp_flags |= SNULL_XDP_TX;
+		return XDP_TX;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(q->dev, xdp, prog))
+			goto err;
+		*xdp_flags |= SNULL_XDP_REDIR;
+		return XDP_REDIRECT;
+	default:
+		bpf_warn_invalid_xdp_action(act);
+		/* fall through */
+	case XDP_ABORTED:
+err:
+		trace_xdp_exception(q->dev, prog, act);
+		/* fall through */
+	case XDP_DROP:
+		return XDP_DROP;
+	}
+}
+
+/* XDP_PASS之后在原来的缓冲区上建skb，不再拷贝，head是缓冲区的开头 */
+static struct sk_buff *snull_xdp_build_skb(struct snull_queue *q, void *head, struct xdp_buff *xdp)
+{
+	unsigned int headroom = xdp->data - head;
+	unsigned int len = xdp->data_end - xdp->data;
+	unsigned int metalen = xdp->data - xdp->data_meta;
+	struct sk_buff *skb;
+
+	skb = build_skb(head, SKB_DATA_ALIGN(headroom + len) +
+			SKB_DATA_ALIGN(sizeof(struct skb_shared_info)));
+	if (!skb)
+		return NULL;
+
+	skb_reserve(skb, headroom);
+	skb_put(skb, len);
+	if (metalen)
+		skb_metadata_set(skb, metalen);
+	skb->protocol = eth_type_trans(skb, q->dev);
+	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+	skb_record_rx_queue(skb, q->index);
+
+	return skb;
+}
+
+/* 拷贝路径收到的包：拷贝到页面中运行XDP程序，返回要交给协议栈的skb */
+static struct sk_buff *snull_rx_xdp(struct snull_queue *q, struct bpf_prog *prog,
+				    struct snull_packet *pkt, unsigned int *xdp_flags)
+{
+	struct xdp_buff xdp;
+	struct sk_buff *skb;
+	struct page *page;
+	void *head;
+	u32 act;
+
+	page = dev_alloc_page();
+	if (!page) {
+		q->rx_dropped++;
+		return NULL;
+	}
+	head = page_address(page);
+	memcpy(head + XDP_PACKET_HEADROOM, pkt->data, pkt->datalen);
+
+	xdp.data_hard_start = head;
+	xdp.data = head + XDP_PACKET_HEADROOM;
+	xdp.data_end = xdp.data + pkt->datalen;
+	xdp.data_meta = xdp.data;
+	xdp.rxq = &q->xdp_rxq;
+
+	act = snull_run_xdp(q, prog, &xdp, xdp_flags);
+	if (act == XDP_TX || act == XDP_REDIRECT)
+		return NULL;
+
+	if (act == XDP_PASS) {
+		skb = snull_xdp_build_skb(q, head, &xdp);
+		if (skb)
+			return skb;
+	}
+	put_page(page);
+	q->rx_dropped++;
+	return NULL;
+}
+
+/* 对端XDP_TX或者ndo_xdp_xmit发过来的帧，数据已经在页面中，不用拷贝 */
+static struct sk_buff *snull_rx_frame(struct snull_queue *q, struct bpf_prog *prog,
+				      struct xdp_frame *frame, unsigned int *xdp_flags)
+{
+	/* xdp_frame本身放在缓冲区的开头，headroom不包括它 */
+	void *hard_start = frame->data - frame->headroom;
+	void *head = hard_start - sizeof(struct xdp_frame);
+	struct xdp_buff xdp;
+	struct sk_buff *skb;
+	u32 act = XDP_PASS;
+
+	if (prog) {
+		xdp.data_hard_start = hard_start;
+		xdp.data = frame->data;
+		xdp.data_end = frame->data + frame->len;
+		xdp.data_meta = frame->data - frame->metasize;
+		xdp.rxq = &q->xdp_rxq;
+
+		/* 帧可能来自别的网卡，再交出去时要按帧原来的内存类型释放 */
+		q->xdp_rxq.mem = frame->mem;
+		act = snull_run_xdp(q, prog, &xdp, xdp_flags);
+		q->xdp_rxq.mem = q->xdp_mem;
+		if (act == XDP_TX || act == XDP_REDIRECT)
+			return NULL;
+	} else {
+		xdp.data = frame->data;
+		xdp.data_end = frame->data + frame->len;
+		xdp.data_meta = frame->data - frame->metasize;
+	}
+
+	if (act == XDP_PASS) {
+		skb = snull_xdp_build_skb(q, head, &xdp);
+		if (skb) {
+			xdp_release_frame(frame);
+			return skb;
+		}
+	}
+	xdp_return_frame(frame);
+	q->rx_dropped++;
+	return NULL;
+}
+
+/*
+ * NAPI的轮询函数，在NET_RX软中断中执行
+ * 每次最多从接收队列取budget个包，取完之后才重新打开接收中断
+ * 每个接收队列有自己的NAPI，不同队列的轮询可以同时在不同的CPU上运行
+ */
+static int snull_poll(struct napi_struct *napi, int budget)
+{
+	int npackets = 0;
+	unsigned long flags;
+	struct sk_buff *skb;
+	struct snull_queue *q = container_of(napi, struct snull_queue, napi);
+	struct net_device *dev = q->dev;
+	struct snull_priv *priv = netdev_priv(dev);
+	unsigned int xdp_flags = 0;
+	struct xdp_frame *frame;
+	struct snull_packet *pkt;
+	struct bpf_prog *prog;
+	int ring;
+
+	rcu_read_lock();
+	prog = rcu_dereference(priv->xdp_prog);
+
+	/* 对端XDP_TX或者重定向过来的帧，挂了程序时在这里也要运行 */
+	while (npackets < budget && (frame = __ptr_ring_consume(&q->xdp_ring))) {
+		q->rx_packets++;
+		q->rx_bytes += frame->len;
+		skb = snull_rx_frame(q, prog, frame, &xdp_flags);
+		if (skb)
+			napi_gro_receive(napi, skb);
+		npackets++;
+	}
+
+	/* 对端直接交过来的skb已经是对端的了，eth_type_trans去掉了以太网头部 */
+	while (npackets < budget && (skb = snull_dequeue_skb(q))) {
+		q->rx_packets++;
+		q->rx_bytes += skb->len + ETH_HLEN;
+		napi_gro_receive(napi, skb);
+		npackets++;
+	}
+
+	while (npackets < budget && (pkt = snull_dequeue_buf(q))) {
+		if (prog) {
+			q->rx_packets++;
+			q->rx_bytes += pkt->datalen;
+			skb = snull_rx_xdp(q, prog, pkt, &xdp_flags);
+			snull_release_buffer(pkt);
+			if (skb)
+				napi_gro_receive(napi, skb);
+			npackets++;
+			continue;
+		}
+
+		skb = dev_alloc_skb(pkt->datalen + 2);
+		if (!skb) {
+			if (printk_ratelimit())
+				printk(KERN_NOTICE "snull: packet dropped\n");
+			q->rx_dropped++;
+			npackets++;
+			snull_release_buffer(pkt);
+			continue;
+		}
+		skb_reserve(skb, 2); /* align IP on 16B boundary */
+		memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
+		skb->dev = dev;
+		skb->protocol = eth_type_trans(skb, dev);
+		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+		skb_record_rx_queue(skb, q->index);
+		/* 同一个流的包在GRO中合并之后再交给协议栈 */
+		napi_gro_receive(napi, skb);
+
+		npackets++;
+		q->rx_packets++;
+		q->rx_bytes += pkt->datalen;
+		snull_release_buffer(pkt);
+	}
+
+	if (xdp_flags & SNULL_XDP_TX)
+		snull_xdp_flush(dev, q->index);
+	if (xdp_flags & SNULL_XDP_REDIR)
+		xdp_do_flush_map();
+	rcu_read_unlock();
+
+	if (npackets < budget && napi_complete_done(napi, npackets)) {
+		/*
+		 * 持有锁打开接收中断并检查队列：在这之前入队的包由这里重新调度，
+		 * 在这之后入队的包，发送端一定能看到中断已经打开
+		 */
+		spin_lock_irqsave(&q->lock, flags);
+		snull_rx_ints(q, 1);
+		pkt = q->rx_queue;
+		skb = skb_peek(&q->rx_skbs);
+		ring = !__ptr_ring_empty(&q->xdp_ring);
+		spin_unlock_irqrestore(&q->lock, flags);
+
+		if ((pkt || skb || ring) && napi_schedule_prep(napi)) {
+			snull_rx_ints(q, 0);
+			__napi_schedule(napi);
+		}
+	}
+
+	return npackets;
+}
+
+/*
+ * NAPI模式的中断：接收中断不再处理包，关掉接收中断之后调度NAPI
+ * 发送完成中断和普通模式一样
+ */
+static void snull_napi_interrupt(int irq, void *dev_id, struct pt_regs *regs)
+{
+	int statusword;
+	struct snull_queue *q = (struct snull_queue *)dev_id;
+
+	/* paranoid */
+	if (!q)
+		return;
+
+	spin_lock(&q->lock);
+	statusword = q->status;
+	q->status = 0;
+
+	if (statusword & SNULL_RX_INTR) {
+		snull_rx_ints(q, 0);	/* 关掉接收中断，后面的包由snull_poll取 */
+		napi_schedule(&q->napi);
+	}
+
+	if (statusword & SNULL_TX_INTR) {
+		q->tx_packets++;
+		q->tx_bytes += q->tx_packetlen;
+		dev_kfree_skb(q->skb);
+	}
+	spin_unlock(&q->lock);
+}
+
+static void snull_hw_tx(char *buf, int len, struct snull_queue *q)
 {
 	struct iphdr *ih;
+	struct net_device *dev = q->dev;
 	struct net_device *dest;
-	struct snull_priv *priv;
+	struct snull_queue *dq;
 	u32 *saddr, *daddr;
 	struct snull_packet *tx_buffer;
 
@@ -345,66 +956,192 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 	/*
 	 * 数据包准备好了
 	 * 要模拟两个中断：一个是在接收端模拟接收中断，另一个实在发送端模拟发送完成中断
-	 * 通过设置私有变量的状态来模拟priv->status
+	 * 通过设置队列的状态来模拟q->status
 	 */
 	//dest = snull_devs[dev == snull_devs[0] ? 1 : 0]; /* 如果源是snull_devs[0],目的则是snull_devs[1] */
 	/* 获取目的网卡地址 */
 	if (dev == snull_devs[0]) {
-		dev = snull_devs[0];
 		dest = snull_devs[1];
 		printk(KERN_INFO "snull_devs[0]\n");
 	} else {
-		dev = snull_devs[1];
 		dest = snull_devs[0];
 		printk(KERN_INFO "snull_dev[1]\n");
 	}
-	
-	/* 处理目的端：接收 */
-	priv = netdev_priv(dest);
-	/* 取出一块内存，分配给本地网卡 */
-	tx_buffer = snull_get_tx_buffer(dev);
+
+	/* 处理目的端：接收，发送队列i的包交给对端的接收队列i */
+	dq = snull_get_queue(dest, q->index);
+	/* 从本端这个队列的包池取出一块内存 */
+	tx_buffer = snull_get_tx_buffer(q);
+	if (tx_buffer == NULL) {
+		/* 发送队列停了之后不会再进来，这里只是防御 */
+		q->tx_dropped++;
+		dev_kfree_skb(q->skb);
+		return;
+	}
 	/* 设置数据包大小 */
 	tx_buffer->datalen = len;
 	printk(KERN_INFO "tx_buffer->datalen = %d\n", tx_buffer->datalen);
 	/* 填充发送网卡的数据 */
 	memcpy(tx_buffer->data, buf, len);
 	/* 把发送的数据直接加入到接收队列
-	 * 这里相当于本地网卡要发送的数据已经给目标网卡直接接收到了 
+	 * 这里相当于本地网卡要发送的数据已经给目标网卡直接接收到了
 	 */
-	snull_enqueue_buf(dest, tx_buffer);
-	if (priv->rx_int_enabled) {
-		priv->status |= SNULL_RX_INTR;	/* 目的端收到数据包之后，模拟触发接收中断 */
-		snull_interrupt(0, dest, NULL);
-		printk(KERN_INFO "priv->status = %d\n", priv->status);
+	snull_enqueue_buf(dq, tx_buffer);
+	if (dq->rx_int_enabled) {
+		snull_set_status(dq, SNULL_RX_INTR);	/* 目的端收到数据包之后，模拟触发接收中断 */
+		snull_interrupt(0, dq, NULL);
+		printk(KERN_INFO "dq->status = %d\n", dq->status);
 	}
 
 	/* 处理源端：发送 */
-	priv = netdev_priv(dev);
-	/* 把本地网卡要发送的数据存到私有数据缓冲区 */
-	priv->tx_packetlen = len;
-	priv->tx_packetdata = buf;
+	/* 把本地网卡要发送的数据存到队列的缓冲区 */
+	q->tx_packetlen = len;
+	q->tx_packetdata = buf;
 	/* 模拟产生一个发送中断 */
-	priv->status |= SNULL_TX_INTR;	/* 源端发送完了，触发发送中断 */
-	snull_interrupt(0, dev, NULL);
-	printk(KERN_INFO "snull_interrupt(0, dev, NULL)\n");
+	snull_set_status(q, SNULL_TX_INTR);	/* 源端发送完了，触发发送中断 */
+	snull_interrupt(0, q, NULL);
+	printk(KERN_INFO "snull_interrupt(0, q, NULL)\n");
+}
+
+/*
+ * 在skb中原地改写IP地址，同时修正TCP/UDP校验和中的伪首部部分
+ * CHECKSUM_PARTIAL的包(包括TSO的超级包)校验和字段里只有伪首部的和，
+ * inet_proto_csum_replace4按ip_summed分别处理，对端分段或者转发出去时校验和仍然正确
+ */
+static int snull_rewrite_ip(struct sk_buff *skb)
+{
+	unsigned int off = sizeof(struct ethhdr), l4;
+	__be32 flip = htonl(0x100);	/* 第三个字节的最低位，和拷贝路径的^= 1一样 */
+	__sum16 *check = NULL;
+	struct iphdr *ih;
+	int udp;
+
+	if (skb->len < off + sizeof(struct iphdr) ||
+	    skb_ensure_writable(skb, off + sizeof(struct iphdr)))
+		return -EINVAL;
+
+	ih = (struct iphdr *)(skb->data + off);
+	if (ih->ihl < 5 || skb_ensure_writable(skb, off + ih->ihl * 4))
+		return -EINVAL;
+
+	/* 只有第一个分片带传输层首部，首部不完整的包只改IP */
+	ih = (struct iphdr *)(skb->data + off);
+	l4 = off + ih->ihl * 4;
+	udp = ih->protocol == IPPROTO_UDP;
+	if (!(ih->frag_off & htons(IP_OFFSET))) {
+		if (ih->protocol == IPPROTO_TCP &&
+		    !skb_ensure_writable(skb, l4 + sizeof(struct tcphdr)))
+			check = &((struct tcphdr *)(skb->data + l4))->check;
+		else if (udp && !skb_ensure_writable(skb, l4 + sizeof(struct udphdr)))
+			check = &((struct udphdr *)(skb->data + l4))->check;
+	}
+
+	/* skb_ensure_writable可能换了头部，重新取IP头 */
+	ih = (struct iphdr *)(skb->data + off);
+	/* UDP校验和为0表示发送端没有计算 */
+	if (check && (!udp || *check || skb->ip_summed == CHECKSUM_PARTIAL)) {
+		inet_proto_csum_replace4(check, skb, ih->saddr, ih->saddr ^ flip, true);
+		inet_proto_csum_replace4(check, skb, ih->daddr, ih->daddr ^ flip, true);
+		if (udp && !*check && skb->ip_summed != CHECKSUM_PARTIAL)
+			*check = CSUM_MANGLED_0;
+	}
+	ih->saddr ^= flip;
+	ih->daddr ^= flip;
+	ih->check = 0;
+	ih->check = ip_fast_csum((unsigned char *)ih, ih->ihl);
+
+	return 0;
+}
+
+/*
+ * 零拷贝发送：只在原地改写IP地址和校验和，skb本身交给对端网卡同一序号的接收队列
+ * skb被克隆过(例如tcpdump抓包)时，skb_ensure_writable先复制一份头部再改
+ * 返回0表示skb已经交出去或者丢掉了，否则skb没有动过，走snull_packet的拷贝路径
+ */
+static int snull_tx_zerocopy(struct sk_buff *skb, struct snull_queue *q)
+{
+	struct net_device *dest = snull_devs[q->dev == snull_devs[0] ? 1 : 0];
+	struct snull_queue *dq = snull_get_queue(dest, q->index);
+	unsigned long flags;
+	unsigned int len;
+
+	if (snull_rewrite_ip(skb))
+		return -EINVAL;
+
+	/* 和拷贝路径一样，短包用0填充到60字节，失败时skb已经被释放 */
+	if (skb_put_padto(skb, ETH_ZLEN)) {
+		q->tx_dropped++;
+		return 0;
+	}
+
+	/*
+	 * 和veth一样，清掉发送端的路由和conntrack，eth_type_trans之后skb属于对端
+	 * 这里只改发送端自己的统计，对端的接收统计由对端在收包的上下文中修改
+	 */
+	len = skb->len;
+	if (__dev_forward_skb(dest, skb)) {
+		q->tx_dropped++;
+		return 0;
+	}
+	q->tx_packets++;
+	q->tx_bytes += len;
+	if (skb->ip_summed == CHECKSUM_NONE)
+		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+	skb_record_rx_queue(skb, dq->index);
+
+	if (!use_napi) {
+		/* 非NAPI模式对端在中断中持有dq->lock修改接收统计 */
+		spin_lock_irqsave(&dq->lock, flags);
+		dq->rx_packets++;
+		dq->rx_bytes += len;
+		spin_unlock_irqrestore(&dq->lock, flags);
+		netif_rx(skb);
+		return 0;
+	}
+
+	snull_enqueue_skb(dq, skb);
+	if (dq->rx_int_enabled) {
+		snull_set_status(dq, SNULL_RX_INTR);
+		snull_interrupt(0, dq, NULL);
+	}
+	return 0;
 }
 
-/* 
+/*
  * tx函数是协议栈决定何时调用
  * 在初始化网络设备时，挂接.ndo_start_xmit	    = snull_tx
+ * 协议栈已经选好了发送队列并持有这个队列的锁，同一个队列的发送不会并发
  */
 int snull_tx(struct sk_buff *skb, struct net_device *dev)
 {
 	int len;
 	char *data, shortpkt[ETH_ZLEN];
-	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = snull_get_queue(dev, skb_get_queue_mapping(skb));
+	struct snull_priv *ppriv = netdev_priv(snull_peer(dev));
+	/* 对端挂了XDP程序时走拷贝路径，XDP在对端的页面上运行 */
+	int xdp = rcu_access_pointer(ppriv->xdp_prog) != NULL;
+
+	/*
+	 * 超级包(TSO)和巨帧放不进snull_packet，不管zerocopy是否打开都整个交给对端，
+	 * 对端的协议栈直接收下整个超级包，或者在GRO中继续合并
+	 */
+	if ((zerocopy && !xdp) || skb_is_gso(skb) || skb->len > ETH_FRAME_LEN) {
+		if (!snull_tx_zerocopy(skb, q))
+			return NETDEV_TX_OK;
+		if (skb_is_gso(skb) || skb->len > ETH_FRAME_LEN)
+			goto drop;
+	}
+
+	/* 打开了NETIF_F_SG，拷贝路径需要线性的数据 */
+	if (skb_linearize(skb))
+		goto drop;
 
 	/* 获取上层要发送的数据和长度 */
 	data = skb->data;
 	len = skb->len;
 	printk(KERN_INFO "skb->len = %d\n", skb->len);
 	printk(KERN_INFO "***start %s tx process***\n", dev->name);
-	printk(KERN_INFO "name:%s data_len:%d\n", dev->name, len);
+	printk(KERN_INFO "name:%s queue:%u data_len:%d\n", dev->name, q->index, len);
 	/* 如果小于60字节，用0填充，最终修改了data,len*/
 	if (len < ETH_ZLEN) {
 		memset(shortpkt, 0, ETH_ZLEN);
@@ -413,22 +1150,39 @@ int snull_tx(struct sk_buff *skb, struct net_device *dev)
 		data = shortpkt;
 	}
 
-	/* 
-	 * 用私有变量记录skb，以便在发送完成
-	 * 调用中断的时候，释放skb 
+	/*
+	 * 用队列记录skb，以便在发送完成
+	 * 调用中断的时候，释放skb
 	 */
-	priv->skb = skb;
+	q->skb = skb;
 	/* 模拟把数据写入硬件，通过硬件发送出去，实际不是 */
-	snull_hw_tx(data, len, dev);
+	snull_hw_tx(data, len, q);
 	printk(KERN_INFO "****stop %s tx process***\n", dev->name);
 
 	return 0; /* Our simple device can not fail */
+
+drop:
+	q->tx_dropped++;
+	dev_kfree_skb(skb);
+	return NETDEV_TX_OK;
 }
 
-struct net_device_stats *snull_stats(struct net_device *dev)
+/* 统计分散在各个队列中，读的时候再加起来 */
+void snull_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	return &priv->stats;
+	struct snull_queue *q;
+	int i;
+
+	for (i = 0; i < priv->num_queues; i++) {
+		q = &priv->queues[i];
+		stats->rx_packets += q->rx_packets;
+		stats->rx_bytes += q->rx_bytes;
+		stats->rx_dropped += q->rx_dropped;
+		stats->tx_packets += q->tx_packets;
+		stats->tx_bytes += q->tx_bytes;
+		stats->tx_dropped += q->tx_dropped;
+	}
 }
 
 int snull_header(struct sk_buff *skb, struct net_device *dev,
@@ -502,22 +1256,81 @@ int snull_header(struct sk_buff *skb, struct net_device *dev,
 */
 int snull_change_mtu(struct net_device *dev, int new_mtu)
 {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(dev);
-	spinlock_t *lock = &priv->lock;
-
-	/* check ranges */
-	if ((new_mtu < 68) || (new_mtu > 1500))
+	/* check ranges，超过1500的巨帧走整个skb交给对端的路径 */
+	if ((new_mtu < ETH_MIN_MTU) || (new_mtu > ETH_MAX_MTU))
 		return -EINVAL;
 	/*
 	* Do anything you need, and the accept the value
+	* 调用时持有rtnl锁，各个队列的锁不用再拿
 	*/
-	spin_lock_irqsave(lock, flags);
 	dev->mtu = new_mtu;
-	spin_unlock_irqrestore(lock, flags);
 	return 0; /* success */
 }
 
+/* 对端挂了XDP程序时，包要一帧一帧地经过XDP，关掉TSO由协议栈分段 */
+static netdev_features_t snull_fix_features(struct net_device *dev, netdev_features_t features)
+{
+	struct net_device *peer = snull_peer(dev);
+	struct snull_priv *ppriv;
+
+	if (!peer)
+		return features;
+
+	ppriv = netdev_priv(peer);
+	if (rtnl_dereference(ppriv->xdp_prog))
+		features &= ~(NETIF_F_TSO | NETIF_F_TSO_ECN);
+
+	return features;
+}
+
+static int snull_xdp_set(struct net_device *dev, struct bpf_prog *prog,
+			 struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct net_device *peer = snull_peer(dev);
+	struct bpf_prog *old;
+
+	if (prog && !use_napi) {
+		NL_SET_ERR_MSG_MOD(extack, "XDP needs use_napi=1");
+		return -EOPNOTSUPP;
+	}
+	if (prog && peer->mtu > SNULL_XDP_MAX_MTU) {
+		NL_SET_ERR_MSG_MOD(extack, "Peer MTU too large for XDP");
+		return -EOPNOTSUPP;
+	}
+
+	old = rtnl_dereference(priv->xdp_prog);
+	rcu_assign_pointer(priv->xdp_prog, prog);
+	/* 正在轮询的NAPI可能还在用旧程序，bpf_prog_put在RCU之后才释放 */
+	if (old)
+		bpf_prog_put(old);
+
+	/* 挂上或者摘掉程序时限制对端的MTU并更新对端的TSO */
+	if (!old != !prog && peer->reg_state == NETREG_REGISTERED) {
+		peer->max_mtu = prog ? SNULL_XDP_MAX_MTU : ETH_MAX_MTU;
+		netdev_update_features(peer);
+	}
+
+	return 0;
+}
+
+static int snull_xdp(struct net_device *dev, struct netdev_bpf *xdp)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct bpf_prog *prog;
+
+	switch (xdp->command) {
+	case XDP_SETUP_PROG:
+		return snull_xdp_set(dev, xdp->prog, xdp->extack);
+	case XDP_QUERY_PROG:
+		prog = rtnl_dereference(priv->xdp_prog);
+		xdp->prog_id = prog ? prog->aux->id : 0;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
 static const struct header_ops snull_header_ops = {
 	.create = snull_header,
 };
@@ -526,38 +1339,102 @@ struct net_device_ops snull_netdev_ops = {
 	.ndo_open	     = snull_open,
 	.ndo_stop	     = snull_release,
 	.ndo_start_xmit      = snull_tx,
-	.ndo_get_stats	     = snull_stats,
+	.ndo_get_stats64     = snull_get_stats64,
+	.ndo_change_mtu	     = snull_change_mtu,
+	.ndo_fix_features    = snull_fix_features,
+	.ndo_bpf	     = snull_xdp,
+	.ndo_xdp_xmit	     = snull_xdp_xmit,
+};
+
+/* 发送环的大小就是每个队列包池的大小，snull没有接收环 */
+static void snull_get_ringparam(struct net_device *dev, struct ethtool_ringparam *ring)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	ring->tx_max_pending = SNULL_MAX_POOL;
+	ring->tx_pending = priv->queues[0].pool_count;
+}
+
+static int snull_set_ringparam(struct net_device *dev, struct ethtool_ringparam *ring)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i, ret;
+
+	if (ring->rx_pending || ring->rx_mini_pending || ring->rx_jumbo_pending)
+		return -EINVAL;
+	if (ring->tx_pending < 1 || ring->tx_pending > SNULL_MAX_POOL)
+		return -EINVAL;
+
+	for (i = 0; i < priv->num_queues; i++) {
+		ret = snull_resize_pool(&priv->queues[i], ring->tx_pending);
+		if (ret)
+			return ret;
+	}
+	printk(KERN_INFO "%s: pool size %u\n", dev->name, ring->tx_pending);
+
+	return 0;
+}
+
+static const struct ethtool_ops snull_ethtool_ops = {
+	.get_ringparam	     = snull_get_ringparam,
+	.set_ringparam	     = snull_set_ringparam,
 };
 
 void snull_init(struct net_device *dev)
 {
 	struct snull_priv *priv;
+	struct snull_queue *q;
+	int i;
 
 	ether_setup(dev); /* assign some of the fields */
 
 	dev->header_ops = &snull_header_ops;
 	dev->netdev_ops = &snull_netdev_ops;
+	dev->ethtool_ops = &snull_ethtool_ops;
 
 	dev->flags |= IFF_NOARP;
-	dev->features |= NETIF_F_HW_CSUM;
+	/*
+	 * 支持分散/聚集和TSO，协议栈交下来最大64K的超级包，snull不分段，直接交给对端
+	 * 巨帧的MTU最大到64K，可以用ethtool -K关掉某个特性做对比
+	 */
+	dev->hw_features = NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_TSO | NETIF_F_TSO_ECN;
+	dev->features |= dev->hw_features;
+	dev->max_mtu = ETH_MAX_MTU;
 
 	priv = netdev_priv(dev);
-	memset(priv, 0, sizeof(struct snull_priv));
-	
-	spin_lock_init(&priv->lock);
-	snull_rx_ints(dev, 1);
-	snull_setup_pool(dev);
+	memset(priv, 0, sizeof(struct snull_priv) + num_queues * sizeof(struct snull_queue));
+	priv->dev = dev;
+	priv->num_queues = num_queues;
+	for (i = 0; i < num_queues; i++) {
+		q = &priv->queues[i];
+		q->dev = dev;
+		q->index = i;
+		skb_queue_head_init(&q->rx_skbs);
+		if (use_napi)
+			netif_napi_add(dev, &q->napi, snull_poll, NAPI_POLL_WEIGHT);
+
+		spin_lock_init(&q->lock);
+		snull_rx_ints(q, 1);
+		snull_setup_pool(q);
+	}
 	printk(KERN_INFO "snull init\n");
 }
 
 void snull_module_exit(void)
 {
-	int i;
+	struct snull_priv *priv;
+	int i, j;
+
+	/* 先把两个网卡都注销，摘掉XDP程序时还要访问对端 */
+	for (i = 0; i < 2; i++)
+		if (snull_devs[i])
+			unregister_netdev(snull_devs[i]);
 
 	for (i = 0; i < 2; i++) {
 		if (snull_devs[i]) {
-			unregister_netdev(snull_devs[i]);
-			snull_teardown_pool(snull_devs[i]);
+			priv = netdev_priv(snull_devs[i]);
+			for (j = 0; j < priv->num_queues; j++)
+				snull_teardown_pool(&priv->queues[j]);
 			free_netdev(snull_devs[i]);
 		}
 	}
@@ -570,11 +1447,25 @@ int snull_module_init(void)
 	int ret = -ENOMEM;
 	int i = 0;
 	int result = 0;
+	size_t priv_size;
+
+	if (num_queues < 1 || num_queues > SNULL_MAX_QUEUES) {
+		printk(KERN_INFO "snull: num_queues should be 1..%d\n", SNULL_MAX_QUEUES);
+		return -EINVAL;
+	}
+	if (pool_size < 1 || pool_size > SNULL_MAX_POOL) {
+		printk(KERN_INFO "snull: pool_size should be 1..%d\n", SNULL_MAX_POOL);
+		return -EINVAL;
+	}
 
-	snull_interrupt = snull_regular_interrupt;
+	snull_interrupt = use_napi ? snull_napi_interrupt : snull_regular_interrupt;
 
-	snull_devs[0] = alloc_netdev(sizeof(struct snull_priv), "sn%d", NET_NAME_UNKNOWN, snull_init);
-	snull_devs[1] = alloc_netdev(sizeof(struct snull_priv), "sn%d", NET_NAME_UNKNOWN, snull_init);
+	/* 发送队列和接收队列一样多，发送队列i对应对端的接收队列i */
+	priv_size = sizeof(struct snull_priv) + num_queues * sizeof(struct snull_queue);
+	snull_devs[0] = alloc_netdev_mqs(priv_size, "sn%d", NET_NAME_UNKNOWN, snull_init,
+			num_queues, num_queues);
+	snull_devs[1] = alloc_netdev_mqs(priv_size, "sn%d", NET_NAME_UNKNOWN, snull_init,
+			num_queues, num_queues);
 
 	if (snull_devs[0] == NULL || snull_devs[1] == NULL)
 		goto out;